@@ -1,14 +1,29 @@
 CC = gcc
-CFLAGS = -Wall -Wextra -pthread
+CFLAGS = -O2 -Wall -Wextra -pthread
 LDFLAGS = -lcrypto
 
-all: proxy
+all: proxy proxy_trace dfc dfs rs_bench lz_test
 
-proxy: proxy.c
+proxy: proxy.c proxy_trace.h
 	$(CC) $(CFLAGS) -o proxy proxy.c $(LDFLAGS)
 
+proxy_trace: proxy_trace.c proxy_trace.h
+	$(CC) $(CFLAGS) -o proxy_trace proxy_trace.c
+
+dfc: dfc.c dfs_proto.h rs.c rs.h crc32c.c crc32c.h lz.c lz.h
+	$(CC) $(CFLAGS) -o dfc dfc.c rs.c crc32c.c lz.c $(LDFLAGS)
+
+dfs: dfs.c dfs_proto.h crc32c.c crc32c.h
+	$(CC) $(CFLAGS) -o dfs dfs.c crc32c.c
+
+rs_bench: rs_bench.c rs.c rs.h
+	$(CC) $(CFLAGS) -o rs_bench rs_bench.c rs.c
+
+lz_test: lz_test.c lz.c lz.h
+	$(CC) $(CFLAGS) -o lz_test lz_test.c lz.c
+
 clean:
-	rm -f proxy
+	rm -f proxy proxy_trace dfc dfs rs_bench lz_test
 	rm -rf cache
 
 .PHONY: all clean
\ No newline at end of file
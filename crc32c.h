@@ -0,0 +1,16 @@
+// CRC32C (Castagnoli), the per-chunk checksum dfs stores and dfc checks
+//SSE4.2's crc32 instruction on x86 cpus that have it, slicing-by-8 tables otherwise
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// crc of data appended to a message whose crc so far is crc (0 to start):
+//crc32c(crc32c(0, a, n), b, m) == crc of a followed by b
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// implementation in use ("sse4.2" or "table")
+const char *crc32c_kernel_name(void);
+
+#endif
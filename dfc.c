@@ -1,6 +1,8 @@
+#define _GNU_SOURCE  //fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -8,16 +10,45 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <openssl/md5.h>
+#include <openssl/sha.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include "dfs_proto.h"
+#include "rs.h"
+#include "crc32c.h"
+#include "lz.h"
 
-#define MAX_SERVERS 10
+#define MAX_SERVERS DFS_MAX_SERVERS
 #define MAX_FILENAME 256
 #define BUFFER_SIZE 4096
 #define CONFIG_FILE "dfc.conf"  //reads to config servers; adds each server to list
 #define TIMEOUT_SEC 1
+#define HEALTH_FILE ".dfc_health"  // servers that didn't answer lately, in $HOME (see connect_to_servers)
+#define HEALTH_RETRY_SEC 60        // a server down this long is waited for again
+#define PROGRESS_MS 250  // progress line refresh while transfers run
+#define BUFFER_BUDGET (8 * 1024 * 1024)  // default cap on transfer buffers, "buffer_budget" in dfc.conf
+#define MAX_CHUNKS 64  // chunks (or erasure shards) per file, one bit each in a listing
+#define HEDGE_PERCENTILE 95  // default "hedge" in dfc.conf, 0 = off
+#define HEDGE_SAMPLES 64     // recent chunk reads the hedge delay is worked out from
+#define HEDGE_MIN_MS 10      // never hedge a chunk sooner than this
+#define HEDGE_POLL_MS 2      // how often an idle job looks for a straggler
+#define DEFAULT_RATE 1e8     // bytes/s assumed for a server nothing has been read from yet
+#define DEDUP_NAME 66        // content chunk name: '@' + 64 hex digits of its sha-256
+#define CHECK_WINDOW 128     // CHECK requests in flight per server while asking which chunks it holds
+#define COMPRESS_SAMPLES 16  // blocks compressed to decide whether a file is worth compressing
+#define REPAIR_RATE (64L * 1024 * 1024)  // default "repair_rate" in dfc.conf, bytes/s of repair copies
+#define REPAIR_TIMEOUT_SEC 120  // a repair copy is given this long (the server does the transfer)
+#define PARALLEL_FILES 8     // default "parallel_files" in dfc.conf: files (or batches of small ones) in flight
+#define SMALL_FILE (256 * 1024)  // replicated files up to this size are put in batches
+#define SCHEDULE_LOOKAHEAD 64    // queued files a worker looks through for one whose servers aren't busy
+#define MAX_PARALLEL_FILES 64
 
 //struct to hold server information
 typedef struct {
@@ -26,6 +57,10 @@ typedef struct {
     int port;
     int connected;
     int socket;
+    int binary;             // speaks the binary protocol (else newline text)
+    uint32_t next_id;       // binary request ids on this connection
+    long rtt_us;            // connect time, a stand in for latency
+    double rate;            // bytes/s of recent chunk reads from it (moving average), 0 = none yet
 } Server;
 
 typedef struct {
@@ -33,18 +68,382 @@ typedef struct {
     Server servers[MAX_SERVERS];
 } ServerList;
 
+// one server's share of a put/get, run on its own thread
+typedef struct GetPiece GetPiece;
+typedef struct PackJob PackJob;
+
+// a chunk of a batched put, by the file it belongs to on the wire
+typedef struct {
+    const char *name;
+    uint32_t chunk;
+} WireChunk;
+
+// a server's whole share of a streamed put/get, fed to its job MAX_CHUNKS at a time (stream_worker)
+typedef struct {
+    int *chunks;
+    off_t *offsets;
+    int *piece;             // get: index of each chunk's piece in the job's pieces
+    char *bad;              // didn't get through (or never got its turn)
+    int count;
+    int capacity;
+    void *(*batch)(void *); // worker each batch goes through
+} ChunkQueue;
+
+typedef struct {
+    Server *server;
+    int server_index;       // its place in the server list
+    char *filename;
+    int chunks[MAX_CHUNKS]; // chunk indexes this server handles
+    off_t offsets[MAX_CHUNKS];  // where each of them lives in the local file
+    int chunk_count;
+    long *chunk_len;        // actual length of each chunk (the last one may be short)
+    long chunk_size;        // full chunk length
+    const rs_code *rs;      // erasure put: chunks >= rs->k are parity, computed from data chunks 0..k-1
+    PackJob *pack;          // compressed put: chunks are sent from where this packs them (pack_wait)
+    uint32_t crc[MAX_CHUNKS];   // put: CRC32C of each chunk as sent, checked against the server's ack
+    int bad[MAX_CHUNKS];    // get: chunk didn't arrive intact and has to come from somewhere else
+    int file_fd;            // put: source file, read through mmap windows
+                            // get: output file, written with pwrite at final offsets
+    long window;            // bytes mapped (put) or buffered (get) at a time
+    GetPiece *pieces;       // get: every piece of the round, so an idle job can hedge for the others
+    int piece_count;
+    off_t spare;            // get: hedged copies land past here (one chunk_size slot per piece) until they win
+    char (*names)[DEDUP_NAME];  // dedup: chunk c is content chunk names[c] on the wire, else chunk c + 1 of filename
+    const WireChunk *wire;  // batch: chunk c is wire[c], of whichever file it belongs to
+    ChunkQueue *queue;      // streamed: chunks above are the current batch of this
+    const int *piece_index; // streamed get: pieces[piece_index[c]] is chunk c's piece
+    int more;               // streamed: more batches follow this one
+    int cut_off;            // get: dropped because a hedge won the chunk it was on, not for anything it did
+    int codec;              // get: chunks arrive as CODEC_LZ4 blocks and are decoded into place
+    atomic_long bytes_done; // progress
+    long bytes_total;
+    void *(*worker)(void *);
+    atomic_int finished;    // worker returned
+    int failed;
+    char error[128];
+} TransferJob;
+
+// the per-server jobs of one put or get, built a chunk at a time
+typedef struct {
+    TransferJob base;       // what every job starts as
+    TransferJob jobs[MAX_SERVERS];
+    int slot[MAX_SERVERS];  // server index -> job index + 1, 0 = no job yet
+    int job_count;
+    ChunkQueue queues[MAX_SERVERS];  // streamed plans: job j's chunks (plan_queue)
+    void *(*batch)(void *); // streamed plans: the worker their batches go through
+} TransferPlan;
+
+// one chunk to download and the servers that can supply it (ties go to the earlier one)
+struct GetPiece {
+    int chunk;
+    off_t offset;           // where it goes in the output file
+    long bytes;             // expected length, for progress
+    int ranged;             // a read: just `bytes` of the chunk from `from`, not all of it
+    long from;
+    int sources[MAX_SERVERS];
+    int source_count;
+    unsigned tried;         // bit i set = server i already failed to supply it
+    int done;
+    
+    // this round, shared between its server's job and a hedge from another one
+    int server;             // server it was asked of, -1 = not in the round
+    TransferJob *owner;     // that server's job
+    int owner_sock;
+    pthread_mutex_t lock;   // held to write into the piece's place in the file, or to take it over
+    atomic_int active;      // owner is still on it
+    atomic_long started_us; // when the owner started waiting for it, 0 = still queued behind others
+    atomic_int hedged;      // a duplicate request went out
+    int hedge_server;
+    long hedge_after_us;
+    int hedge_sock;         // the duplicate's connection while it runs, -1 otherwise (under lock)
+    int won;                // 1 = the owner's copy is in place, 2 = the hedge's (under lock)
+};
+
+// a deduplicated file's chunks in file order: cut from the file (put) or read from its recipe (get)
+typedef struct {
+    int count;
+    long *len;
+    off_t *offset;
+    unsigned char (*digest)[SHA256_DIGEST_LENGTH];
+    char (*name)[DEDUP_NAME];
+    int *first;             // first chunk with the same content, itself if none comes before it
+    long longest;
+    int *target;            // put: distinct chunk c's r-th server at c * MAX_SERVERS + r
+    char *have;             // put: and whether that server holds it
+} ContentList;
+
+// a compressed chunk being decoded as it arrives: whole blocks are written out at their raw offset,
+//a partial one waits in `in` for the rest of it
+typedef struct {
+    int fd;
+    off_t offset;           // where the chunk's raw bytes go
+    long done;              // raw bytes written so far
+    uint8_t *in;            // block header + stored bytes received so far
+    long have;
+    uint8_t *out;           // decoded block
+    int malformed;          // a block didn't decode, the rest is ignored
+} ChunkSink;
+
+// the chunks of a compressed replicated put, packed in file order a chunk per thread just ahead of the
+//senders, into a ring of slots in a scratch file that buffer_budget bounds; a slot is taken again
+//once every server its chunk goes to is done with it
+struct PackJob {
+    int src_fd;
+    int dst_fd;
+    const long *chunk_len;
+    long *packed_len;       // compressed length of each chunk, block headers included
+    long chunk_size;
+    long slot;              // room for a chunk in the scratch file (packed_bound)
+    int chunks;
+    int slots;              // slots in the ring, at most 64
+    int next;               // next chunk to pack
+    uint64_t busy;          // bit s = slot s holds a chunk not every server has sent yet
+    int slot_of[MAX_CHUNKS];
+    int ready[MAX_CHUNKS];  // packed into its slot
+    int refs[MAX_CHUNKS];   // servers still to send it
+    uint64_t released[MAX_SERVERS];  // bit c = that server is done with chunk c
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t threads[MAX_CHUNKS];
+    int thread_count;
+};
+
+// a copy the repair wants made: its target server pulls chunk `chunk` of name from `source`
+typedef struct {
+    const char *name;       // points into the listing
+    int chunk;              // wire chunk number, 0 = the layout record
+    int source;
+    long bytes;
+} RepairCopy;
+
+// one target server's repair copies, made one at a time on its own thread and connection
+typedef struct {
+    Server *server;
+    ServerList *server_list;
+    RepairCopy *copies;
+    int count;
+    int capacity;
+    int made;
+    long bytes_made;
+    int failed;
+    char error[128];
+} RepairJob;
+
+// the files of one get or put, handed out to parallel_files workers with connections of their own
+//a worker takes the first queued file none of whose servers are busy (already have per_server
+//files in flight), so a slow or popular server doesn't hold every worker; if there is none it takes
+//the oldest (gets count against every server, see file_servers, so they simply go in order). small
+//replicated files are taken several at a time and put as one batch
+typedef struct {
+    ServerList *config;     // the command's servers and connections (worker 0 uses these)
+    char **files;
+    int count;
+    int put;
+    long *sizes;            // put: file size, -1 if it can't be read (put_file then says why)
+    unsigned *servers;      // bit i = server i takes part in the file's transfer
+    char *taken;
+    int head;               // every file before this one is taken
+    int busy[MAX_SERVERS];  // files and batches in flight on each server
+    int per_server;
+    int batch_max;          // most small files put as one batch
+    pthread_mutex_t lock;
+} FileQueue;
+
+// one worker of a FileQueue
+typedef struct {
+    FileQueue *queue;
+    ServerList *servers;    // the queue's config (worker 0) or own
+    ServerList own;
+} FileWorker;
+
+// one file as seen in one server's listing
+typedef struct {
+    char *name;
+    int server;             // index in the server list
+    unsigned long chunks;   // bit c set = holds chunk c (0 based)
+    int implied;            // text server: only the name is known, chunks follow from placement
+    long chunk_size;        // largest chunk held, 0 if unknown
+    int has_layout;
+    dfs_layout layout;
+} ListedFile;
+
+// one server's listing, fetched on its own thread
+typedef struct {
+    Server *server;
+    int index;
+    ListedFile *files;
+    int count;
+    int capacity;
+    int failed;
+} ListJob;
+
+long buffer_budget = BUFFER_BUDGET;
+int use_binary = 1;  // "protocol text" in dfc.conf keeps to the old text protocol
+int ec_data = 0, ec_parity = 0;  // "erasure <k>+<m>" in dfc.conf, 0 = replication
+int stripe_width = 0;            // "stripe_width <n>", servers a file is spread over, 0 = all
+long stripe_chunk = 0;           // "chunk_size <size>", 0 = one chunk per server of the stripe
+int replica_count = 2;           // "replicas <n>", copies of each chunk
+int hedge_percentile = HEDGE_PERCENTILE;  // "hedge <p>|off": duplicate a read once it runs past this percentile
+long dedup_avg = 0;              // "dedup <size>|off", put -d: content defined chunks of about this size, 0 = off
+int compress_codec = CODEC_NONE; // "compress lz4|off", put -z: compress replicated chunks that shrink
+double repair_rate = REPAIR_RATE;  // "repair_rate <size>|off", repair -l: bytes/s all repair copies share, 0 = no limit
+int parallel_files = PARALLEL_FILES;  // "parallel_files <n>", put/get -j: files transferred at once
+int show_progress = 1;           // run_transfers' progress line, off while several files share the terminal
+
+// gear hash values for content defined chunking, the same on every client (see gear_init)
+uint64_t gear[256];
+int gear_ready = 0;
+
+// repair copies start no sooner than their bytes fit in repair_rate since the pass began
+struct {
+    pthread_mutex_t lock;
+    long start_us;
+    double reserved;        // bytes of copies started so far
+} repair_pacer = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+
+// seconds per byte of the last HEDGE_SAMPLES intact chunk reads, from any server
+double read_samples[HEDGE_SAMPLES];
+int read_sample_count = 0;
+pthread_mutex_t read_sample_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // functions
+long parse_size(const char *text);
+int set_stripe_option(const char *option, const char *value);
+int set_parallel_files(const char *value);
+int recv_line(int sock, char *line, int max);
 void read_config(ServerList *server_list);
+int load_config(const char *path, ServerList *server_list);
+int dial(Server *server);
+int negotiate(Server *server);
+int connect_server(Server *server);
+unsigned dial_servers(ServerList *server_list, unsigned which, unsigned patient);
+unsigned connect_servers(ServerList *server_list, unsigned which, unsigned patient);
+void health_load(ServerList *server_list, long *down);
+void health_save(ServerList *server_list, const long *down);
 void connect_to_servers(ServerList *server_list);
+int send_request(Server *server, int opcode, const char *name, uint32_t chunk, uint64_t length, uint32_t *request_id);
+int send_header(Server *server, const dfs_frame *fields, const char *name, uint32_t *request_id);
+int recv_response(Server *server, dfs_frame *response);
+int server_check(Server *server, const char *filename);
+long server_size(Server *server, const char *filename);
+char *server_list_names(Server *server);
+ListedFile *add_listed(ListJob *job, char *name, int implied);
+void *list_worker(void *arg);
 void put_file(ServerList *server_list, char *filename);
+void run_files(ServerList *server_list, char **files, int count, int put);
+unsigned file_servers(FileQueue *queue, int file, int *entries);
+int batchable(FileQueue *queue, int file);
+int queue_take(FileQueue *queue, int *picked, unsigned *busy);
+void queue_done(FileQueue *queue, unsigned busy);
+void *file_worker(void *arg);
+void put_batch(ServerList *server_list, char **files, const long *sizes, const int *picked, int count);
+void put_striped(ServerList *server_list, char *filename, int file_fd, long file_size);
+void get_striped(ServerList *server_list, char *filename, const dfs_layout *layout);
+void put_erasure(ServerList *server_list, char *filename, int file_fd, long file_size);
 void get_file(ServerList *server_list, char *filename);
+void get_erasure(ServerList *server_list, char *filename, const dfs_layout *layout);
+int put_layout(Server *server, const char *filename, const dfs_layout *layout);
+int put_small(Server *server, const char *filename, int chunk, const char *data, long len);
+void put_dedup(ServerList *server_list, char *filename, int file_fd, long file_size);
+void get_dedup(ServerList *server_list, char *filename, const dfs_layout *layout);
+int load_recipe(ServerList *server_list, char *filename, const dfs_layout *layout, ContentList *list);
+void read_file(ServerList *server_list, char *filename, long start, long len, const char *output);
+int range_piece(GetPiece *piece, int chunk, long chunk_start, long chunk_len, long start, long len);
+void gear_init(void);
+long cdc_cut(const unsigned char *data, long len, long avg);
+void content_name(const unsigned char *digest, char *name);
+int is_content_name(const char *name);
+int cmp_names(const void *a, const void *b, void *names);
+int content_alloc(ContentList *list, long capacity);
+void content_free(ContentList *list);
+int content_repeats(ContentList *list);
+int content_cut(ContentList *list, int fd, long file_size);
+char *content_recipe(const ContentList *list, long *len);
+int content_parse(ContentList *list, const unsigned char *recipe, long len);
+int server_have(Server *server, char (*names)[DEDUP_NAME], const int *which, int count, char *have);
+void content_holders(ServerList *server_list, ContentList *list, int replicas);
+int content_copies(const ContentList *list, int c, int replicas);
+int fetch_layout(ServerList *server_list, const char *filename, dfs_layout *layout);
+long fetch_small(Server *server, const char *filename, int chunk, char *buf, long max);
+void info_file(ServerList *server_list, char *filename);
+void plan_layout(long file_size, int server_count, dfs_layout *layout);
+int layout_server(const dfs_layout *layout, ServerList *server_list, char *filename, int chunk, int replica);
+int rendezvous_server(const dfs_layout *layout, ServerList *server_list, char *filename, int chunk, int replica);
+uint64_t hrw_score(const char *server, const char *filename, int chunk);
+void layout_chunk_len(const dfs_layout *layout, long *chunk_len);
+void plan_init(TransferPlan *plan, char *filename, long *chunk_len, long chunk_size, int fd);
+TransferJob *plan_job(TransferPlan *plan, ServerList *server_list, int index);
+void plan_add(TransferPlan *plan, ServerList *server_list, int index, int chunk, off_t offset, long bytes);
+int plan_queue(TransferPlan *plan, ServerList *server_list, int index, int chunk, off_t offset, long bytes, int piece);
+void plan_free(TransferPlan *plan);
+void plan_windows(TransferPlan *plan);
+void plan_commit(TransferPlan *plan, ServerList *server_list, char *filename, const dfs_layout *layout, int *stored);
+int finish_part(int fd, const char *part_path, const char *filename, off_t size);
+int fetch_pieces(ServerList *server_list, char *filename, int fd, long *chunk_len, long chunk_size,
+                 GetPiece *pieces, int count, char (*names)[DEDUP_NAME], int codec);
+long packed_bound(long chunk_size);
+long pack_block(const uint8_t *raw, long len, uint8_t *out);
+int worth_compressing(int fd, long file_size);
+void *pack_worker(void *arg);
+int pack_start(PackJob *pack, int fd, const dfs_layout *layout, const long *chunk_len, long *packed_len,
+               const TransferPlan *plan);
+int pack_wait(PackJob *pack, int chunk, off_t *offset, long *len);
+void pack_release(PackJob *pack, int server, int chunk);
+void pack_finish(PackJob *pack);
+void *pack_put_worker(void *arg);
+int sink_open(ChunkSink *sink, int fd, off_t offset);
+int sink_write(ChunkSink *sink, const char *data, long len);
+int sink_close(ChunkSink *sink);
+int unpack_region(int fd, off_t from, long len, off_t to, char *buf, long buf_len, long *raw);
+ListedFile *gather_listing(ServerList *server_list, int *count);
+unsigned long listed_chunks(ServerList *server_list, const ListedFile *file);
+int chunk_targets(ServerList *server_list, const ListedFile *file, const dfs_layout *layout, int chunk, int *targets);
 void list_files(ServerList *server_list);
+void show_moves(ServerList *server_list, const char *config_path);
+void reconnect_servers(ServerList *server_list);
+void repair(ServerList *server_list, long interval);
+int repair_pass(ServerList *server_list, int quiet);
+int repair_queue(RepairJob *job, const char *name, int chunk, int source, long bytes);
+void repair_pace(long bytes);
+void *repair_worker(void *arg);
 unsigned int get_file_hash(char *filename);
+void place_chunks(char *filename, int server_count, int chunk_pairs[4][2]);
 int check_file_completeness(ServerList *server_list, char *filename);
+int send_all(int sock, const char *data, long len, atomic_long *progress);
+int recv_all(int sock, char *data, long len, atomic_long *progress);
+int send_range(TransferJob *job, off_t start, long len, uint32_t *crc);
+int send_parity(TransferJob *job, int row, long len, uint32_t *crc);
+const char *wire_name(const TransferJob *job, int chunk, uint32_t *wire_chunk);
+int send_get(Server *server, const TransferJob *job, const GetPiece *piece, int chunk, uint32_t *request_id);
+void text_acks(TransferJob *job, int first, int count);
+void *put_worker(void *arg);
+void *get_worker(void *arg);
+long now_us(void);
+void note_read(Server *server, long bytes, long elapsed_us);
+long hedge_delay_us(long bytes);
+double read_rate(ServerList *server_list, int index);
+int copy_region(int fd, off_t from, off_t to, long len, char *buf, long buf_len);
+int hedge_piece(TransferJob *job, GetPiece *piece, char *window);
+void hedge_idle(TransferJob *job, char *window);
+void *stream_worker(void *arg);
+void *transfer_thread(void *arg);
+int run_transfers(TransferJob *jobs, int job_count, void *(*worker)(void *), const char *verb);
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         printf("usage: %s <command> [filename] ... [filename]\n", argv[0]);
+        printf("       %s put [-w servers|all] [-s chunk_size|auto] [-r replicas] [-e k+m|off] [-d size|off]\n"
+               "           [-z lz4|off] [-j files] file ...\n",
+               argv[0]);
+        printf("       %s get [-j files] file ...   (-j: files transferred at once)\n", argv[0]);
+        printf("       (puts are spread so no server has too many at once; gets go in list order, where their\n"
+               "        chunks are isn't known until each starts)\n");
+        printf("       (flags apply to the files after them)\n");
+        printf("       %s read <file> <start> <length> [output]   just those bytes (default output <file>.range)\n",
+               argv[0]);
+        printf("       %s moves <new dfc.conf>   chunks that move if the servers change to those\n", argv[0]);
+        printf("       %s repair [-l rate|off] [-i seconds]   restore missing replicas (every -i seconds)\n", argv[0]);
         return 1;
     }
 
@@ -65,17 +464,86 @@ int main(int argc, char *argv[]) {
             printf("Error: missing filename for 'get' command\n");
             return 1;
         }
+        char **files = malloc(argc * sizeof(char *));
+        int count = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                run_files(&server_list, files, count, 0);
+                count = 0;
+                if (set_parallel_files(argv[++i]) < 0) {
+                    printf("Error: bad option '-j %s'\n", argv[i]);
+                    return 1;
+                }
+            } else {
+                files[count++] = argv[i];
+            }
+        }
+        run_files(&server_list, files, count, 0);
+        free(files);
+    } else if (strcmp(argv[1], "moves") == 0) {
+        if (argc < 3) {
+            printf("Error: missing config for 'moves' command\n");
+            return 1;
+        }
+        show_moves(&server_list, argv[2]);
+    } else if (strcmp(argv[1], "repair") == 0) {
+        long interval = 0;
+        for (int i = 2; i < argc; i += 2) {
+            if (i + 1 < argc && strcmp(argv[i], "-l") == 0) {
+                repair_rate = strcmp(argv[i + 1], "off") == 0 ? 0 : parse_size(argv[i + 1]);
+            } else if (i + 1 < argc && strcmp(argv[i], "-i") == 0) {
+                interval = atol(argv[i + 1]);
+            } else {
+                printf("Error: bad option '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        if (repair_rate < 0 || interval < 0) {
+            printf("Error: bad repair rate or interval\n");
+            return 1;
+        }
+        repair(&server_list, interval);
+    } else if (strcmp(argv[1], "read") == 0) {
+        if (argc < 5) {
+            printf("Error: 'read' needs a filename, a start and a length\n");
+            return 1;
+        }
+        long start = parse_size(argv[3]), len = parse_size(argv[4]);
+        if (start < 0 || len < 0) {
+            printf("Error: bad range\n");
+            return 1;
+        }
+        char output[MAX_FILENAME + 16];
+        snprintf(output, sizeof(output), "%s.range", argv[2]);
+        read_file(&server_list, argv[2], start, len, argc > 5 ? argv[5] : output);
+    } else if (strcmp(argv[1], "info") == 0) {
         for (int i = 2; i < argc; i++) {
-            get_file(&server_list, argv[i]);
+            info_file(&server_list, argv[i]);
         }
     } else if (strcmp(argv[1], "put") == 0) {
         if (argc < 3) {
             printf("Error: missing filename for 'put' command\n");
             return 1;
         }
+        // files between flags go up together
+        char **files = malloc(argc * sizeof(char *));
+        int count = 0;
         for (int i = 2; i < argc; i++) {
-            put_file(&server_list, argv[i]);
+            if (argv[i][0] == '-' && argv[i][1] && i + 1 < argc) {
+                run_files(&server_list, files, count, 1);
+                count = 0;
+                if (strcmp(argv[i], "-j") == 0 ? set_parallel_files(argv[i + 1]) < 0
+                                               : set_stripe_option(argv[i], argv[i + 1]) < 0) {
+                    printf("Error: bad option '%s %s'\n", argv[i], argv[i + 1]);
+                    return 1;
+                }
+                i++;
+            } else {
+                files[count++] = argv[i];
+            }
         }
+        run_files(&server_list, files, count, 1);
+        free(files);
     } else {
         printf("Error: unknown command '%s'\n", argv[1]);
         return 1;
@@ -96,20 +564,60 @@ void read_config(ServerList *server_list) {
     char config_path[256];
     snprintf(config_path, sizeof(config_path), "%s/%s", getenv("HOME"), CONFIG_FILE);
     
-    FILE *config = fopen(config_path, "r");
-    if (!config) {
+    if (load_config(config_path, server_list) < 0) {
         perror("error opening config file");
         exit(1);
     }
     
+    printf("loaded %d servers from config\n", server_list->count);
+}
+
+// servers and settings from a config file; -1 if it can't be opened
+int load_config(const char *path, ServerList *server_list) {
+    FILE *config = fopen(path, "r");
+    if (!config) {
+        return -1;
+    }
+    
     //add each server to list
     char line[256];
     while (fgets(line, sizeof(line), config)) {
-        if (strncmp(line, "server", 6) == 0) {
+        char value[64];
+        if (sscanf(line, "buffer_budget %63s", value) == 1) {
+            buffer_budget = parse_size(value);
+            if (buffer_budget < 64 * 1024) {
+                buffer_budget = 64 * 1024;
+            }
+        } else if (sscanf(line, "protocol %63s", value) == 1) {
+            use_binary = strcmp(value, "text") != 0;
+        } else if (sscanf(line, "parallel_files %63s", value) == 1) {
+            set_parallel_files(value);
+        } else if (sscanf(line, "repair_rate %63s", value) == 1) {
+            repair_rate = strcmp(value, "off") == 0 ? 0 : parse_size(value);
+            if (repair_rate < 0) {
+                repair_rate = REPAIR_RATE;
+            }
+        } else if (sscanf(line, "hedge %63s", value) == 1) {
+            hedge_percentile = strcmp(value, "off") == 0 ? 0 : atoi(value);
+            if (hedge_percentile < 0 || hedge_percentile > 100) {
+                printf("ignoring hedge %s: need a percentile 1..100 or off\n", value);
+                hedge_percentile = HEDGE_PERCENTILE;
+            }
+        } else if (sscanf(line, "erasure %63s", value) == 1 || sscanf(line, "stripe_width %63s", value) == 1 ||
+                   sscanf(line, "chunk_size %63s", value) == 1 || sscanf(line, "replicas %63s", value) == 1 ||
+                   sscanf(line, "dedup %63s", value) == 1 || sscanf(line, "compress %63s", value) == 1) {
+            char option[32];
+            sscanf(line, "%31s", option);
+            set_stripe_option(option, value);
+        } else if (strncmp(line, "server", 6) == 0) {
             char server_name[64];
             char server_address[256];
             
             if (sscanf(line, "server %s %s", server_name, server_address) == 2) {
+                if (server_list->count == MAX_SERVERS) {
+                    printf("ignoring server %s: at most %d\n", server_name, MAX_SERVERS);
+                    continue;
+                }
                 Server *server = &server_list->servers[server_list->count];
                 strncpy(server->hostname, server_name, sizeof(server->hostname));
                 
@@ -127,456 +635,4118 @@ void read_config(ServerList *server_list) {
     }
     
     fclose(config);
-    
-    printf("loaded %d servers from config\n", server_list->count);
+    return 0;
 }
 
-// connect to available servers (w/ timeout)
-void connect_to_servers(ServerList *server_list) {
+// stripe settings, from dfc.conf or put's -e/-w/-s/-r/-d/-z flags; -1 if value is no good
+int set_stripe_option(const char *option, const char *value) {
+    if (strcmp(option, "erasure") == 0 || strcmp(option, "-e") == 0) {
+        int k, m;
+        if (strcmp(value, "off") == 0) {
+            ec_data = ec_parity = 0;
+        } else if (sscanf(value, "%d+%d", &k, &m) == 2 && k >= 1 && m >= 1 && k + m <= RS_MAX_SHARDS) {
+            ec_data = k;
+            ec_parity = m;
+        } else {
+            printf("ignoring erasure %s: need k+m with k >= 1, m >= 1, k + m <= %d (or off)\n", value, RS_MAX_SHARDS);
+            return -1;
+        }
+    } else if (strcmp(option, "stripe_width") == 0 || strcmp(option, "-w") == 0) {
+        stripe_width = strcmp(value, "all") == 0 ? 0 : atoi(value);
+        if (stripe_width < 0 || stripe_width > MAX_SERVERS) {
+            printf("ignoring stripe width %s: need 1..%d or all\n", value, MAX_SERVERS);
+            stripe_width = 0;
+            return -1;
+        }
+    } else if (strcmp(option, "chunk_size") == 0 || strcmp(option, "-s") == 0) {
+        stripe_chunk = strcmp(value, "auto") == 0 ? 0 : parse_size(value);
+        if (stripe_chunk < 0) {
+            stripe_chunk = 0;
+            return -1;
+        }
+    } else if (strcmp(option, "replicas") == 0 || strcmp(option, "-r") == 0) {
+        replica_count = atoi(value);
+        if (replica_count < 1 || replica_count > MAX_SERVERS) {
+            printf("ignoring replicas %s: need 1..%d\n", value, MAX_SERVERS);
+            replica_count = 2;
+            return -1;
+        }
+    } else if (strcmp(option, "dedup") == 0 || strcmp(option, "-d") == 0) {
+        // average chunk size, a power of two (min and max cut are a quarter and 4x of it)
+        long avg = strcmp(value, "off") == 0 ? 0 : parse_size(value);
+        if (avg != 0 && (avg < 16 * 1024 || avg > 64L * 1024 * 1024)) {
+            printf("ignoring dedup %s: need a chunk size from 16K to 64M, or off\n", value);
+            return -1;
+        }
+        dedup_avg = avg ? 1L << (63 - __builtin_clzl(avg)) : 0;
+    } else if (strcmp(option, "compress") == 0 || strcmp(option, "-z") == 0) {
+        if (strcmp(value, "lz4") == 0) {
+            compress_codec = CODEC_LZ4;
+        } else if (strcmp(value, "off") == 0) {
+            compress_codec = CODEC_NONE;
+        } else {
+            printf("ignoring compress %s: need lz4 or off\n", value);
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// files transferred at once, from dfc.conf or put/get -j; -1 if value is no good
+int set_parallel_files(const char *value) {
+    int files = atoi(value);
+    if (files < 1 || files > MAX_PARALLEL_FILES) {
+        printf("ignoring parallel_files %s: need 1..%d\n", value, MAX_PARALLEL_FILES);
+        return -1;
+    }
+    parallel_files = files;
+    return 0;
+}
+
+// "64K", "8M", "1G" or plain bytes
+long parse_size(const char *text) {
+    char *end;
+    long value = strtol(text, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': return value * 1024;
+        case 'm': case 'M': return value * 1024 * 1024;
+        case 'g': case 'G': return value * 1024 * 1024 * 1024;
+        default: return value;
+    }
+}
+
+// read a '\n' terminated reply line one byte at a time (so no data after it is consumed)
+int recv_line(int sock, char *line, int max) {
+    int len = 0;
+    while (len < max - 1) {
+        char c;
+        if (recv(sock, &c, 1, 0) != 1) {
+            return -1;
+        }
+        if (c == '\n') {
+            break;
+        }
+        line[len++] = c;
+    }
+    line[len] = '\0';
+    return len;
+}
+
+// open a connection to server (w/ 1sec send/recv timeout), -1 if unavailable
+int dial(Server *server) {
     struct timeval tv;
     tv.tv_sec = TIMEOUT_SEC;
     tv.tv_usec = 0;
     
+    // create socket
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+    
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
+    
+    // connect to server
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(server->port);
+    
+    if (inet_pton(AF_INET, server->ip, &serv_addr.sin_addr) <= 0) {
+        printf("invalid address: %s\n", server->ip);
+        close(sock);
+        return -1;
+    }
+    
+    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// binary HELLO on a fresh connection; 1 if the server answers in the binary protocol
+//an old text-only server just waits for a newline, so this costs one recv timeout
+int negotiate(Server *server) {
+    dfs_frame response;
+    server->binary = 1;
+    server->next_id = 0;
+    if (send_request(server, OP_HELLO, NULL, 0, 0, NULL) == 0 && recv_response(server, &response) == 0 &&
+        response.opcode == (OP_HELLO | DFS_RESPONSE) && response.status == ST_OK) {
+        return 1;
+    }
+    server->binary = 0;
+    return 0;
+}
+
+// (re)connect to one server, in the binary protocol if it and dfc.conf allow; 0 ok, -1 if unavailable
+int connect_server(Server *server) {
+    server->binary = 0;
+    long start = now_us();
+    server->socket = dial(server);
+    server->rtt_us = now_us() - start;
+    if (server->socket >= 0 && use_binary && !negotiate(server)) {
+        // old server; it may have half read the hello as a command line, so start over in text
+        close(server->socket);
+        server->socket = dial(server);
+    }
+    server->connected = server->socket >= 0;
+    return server->connected ? 0 : -1;
+}
+
+// dial the servers in `which` (bit i = server i) all at once, with non-blocking connects that share
+//one TIMEOUT_SEC deadline; only the ones in `patient` are waited for, the rest get whatever time that
+//takes. a connected socket is made blocking with the usual timeouts; returns the servers that connected
+unsigned dial_servers(ServerList *server_list, unsigned which, unsigned patient) {
+    struct pollfd fds[MAX_SERVERS];
+    int index[MAX_SERVERS];
+    int pending = 0;
+    unsigned connected = 0;
+    long start = now_us();
+    
     for (int i = 0; i < server_list->count; i++) {
         Server *server = &server_list->servers[i];
+        if (!(which >> i & 1)) continue;
+        server->connected = 0;
+        server->binary = 0;
         
-        // create socket
-        server->socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (server->socket < 0) {
-            perror("Error creating socket");
-            continue;
-        }
-        
-        //set 1sec timeout for connection
-        setsockopt(server->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-        setsockopt(server->socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
-        
-        // connect to server
         struct sockaddr_in serv_addr;
         memset(&serv_addr, 0, sizeof(serv_addr));
         serv_addr.sin_family = AF_INET;
         serv_addr.sin_port = htons(server->port);
-        
         if (inet_pton(AF_INET, server->ip, &serv_addr.sin_addr) <= 0) {
             printf("invalid address: %s\n", server->ip);
-            close(server->socket);
+            server->socket = -1;
             continue;
         }
         
-        if (connect(server->socket, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-            printf("server %s (%s:%d) not available\n", server->hostname, server->ip, server->port);
-            close(server->socket);
+        server->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (server->socket < 0) {
+            perror("Error creating socket");
             continue;
         }
-        
-        server->connected = 1;
-        printf("connected to server %s (%s:%d)\n", server->hostname, server->ip, server->port);
+        if (connect(server->socket, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == 0) {
+            connected |= 1u << i;
+            server->rtt_us = now_us() - start;
+        } else if (errno == EINPROGRESS) {
+            fds[pending].fd = server->socket;
+            fds[pending].events = POLLOUT;
+            index[pending++] = i;
+        } else {
+            close(server->socket);
+            server->socket = -1;
+        }
     }
-}
-
-// hash the filename
-//for distributing chunks
-unsigned int get_file_hash(char *filename) {
-    unsigned char digest[MD5_DIGEST_LENGTH];
-    MD5_CTX md5_context;
-    
-    MD5_Init(&md5_context);
-    MD5_Update(&md5_context, filename, strlen(filename));
-    MD5_Final(digest, &md5_context);
     
-    // use first 4 bytes
-    unsigned int hash_value = 0;
-    memcpy(&hash_value, digest, sizeof(unsigned int));
+    // wait for the patient ones to connect or fail, or the deadline
+    long deadline = start + TIMEOUT_SEC * 1000000L;
+    while (pending > 0) {
+        int waiting = 0;
+        for (int p = 0; p < pending; p++) waiting |= fds[p].fd >= 0 && (patient >> index[p] & 1);
+        long left = deadline - now_us();
+        if (!waiting || left <= 0) break;
+        
+        if (poll(fds, pending, (left + 999) / 1000) < 0 && errno != EINTR) break;
+        for (int p = 0; p < pending; p++) {
+            if (fds[p].fd < 0 || fds[p].revents == 0) continue;
+            Server *server = &server_list->servers[index[p]];
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            if (getsockopt(fds[p].fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0) {
+                connected |= 1u << index[p];
+                server->rtt_us = now_us() - start;
+            } else {
+                close(fds[p].fd);
+                server->socket = -1;
+            }
+            fds[p].fd = -1;  // poll skips it from now on
+        }
+    }
+    for (int p = 0; p < pending; p++) {
+        if (fds[p].fd >= 0) {
+            close(fds[p].fd);
+            server_list->servers[index[p]].socket = -1;
+        }
+    }
     
-    return hash_value;
+    struct timeval tv;
+    tv.tv_sec = TIMEOUT_SEC;
+    tv.tv_usec = 0;
+    for (int i = 0; i < server_list->count; i++) {
+        Server *server = &server_list->servers[i];
+        if (!(connected >> i & 1)) continue;
+        fcntl(server->socket, F_SETFL, fcntl(server->socket, F_GETFL) & ~O_NONBLOCK);
+        setsockopt(server->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+        setsockopt(server->socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
+        server->connected = 1;
+    }
+    return connected;
 }
 
-// implementing PUT command
-void put_file(ServerList *server_list, char *filename) {
-    // check if file exists & readable
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("Error opening file");
-        return;
+// connect_server for many servers at once: dial_servers, then a HELLO to every one of them, answers
+//awaited together; servers that don't answer in the binary protocol are dialed again in text
+unsigned connect_servers(ServerList *server_list, unsigned which, unsigned patient) {
+    unsigned connected = dial_servers(server_list, which, patient);
+    if (!use_binary || !connected) {
+        return connected;
     }
     
-    // get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    rewind(file);
-    
-    // calculate chunk size (ciel)
-    long chunk_size = (file_size + 3) / 4;
-    
-    // allocate memory for file chunks
-    char *chunks[4];
-    for (int i = 0; i < 4; i++) {
-        chunks[i] = malloc(chunk_size);
-        if (!chunks[i]) {
-            perror("memory allocation failed");
-            fclose(file);
-            for (int j = 0; j < i; j++) {
-                free(chunks[j]);
-            }
-            return;
+    struct pollfd fds[MAX_SERVERS];
+    int index[MAX_SERVERS];
+    int pending = 0;
+    unsigned text = 0;
+    for (int i = 0; i < server_list->count; i++) {
+        Server *server = &server_list->servers[i];
+        if (!(connected >> i & 1)) continue;
+        server->binary = 1;
+        server->next_id = 0;
+        if (send_request(server, OP_HELLO, NULL, 0, 0, NULL) < 0) {
+            text |= 1u << i;
+            continue;
         }
-        memset(chunks[i], 0, chunk_size);
+        fds[pending].fd = server->socket;
+        fds[pending].events = POLLIN;
+        index[pending++] = i;
     }
     
-    // read file into chunks
-    for (int i = 0; i < 4; i++) {
-        size_t read_size = fread(chunks[i], 1, chunk_size, file);
-        if (read_size < chunk_size && i < 3 && !feof(file)) {
-            perror("error reading file");
-            fclose(file);
-            for (int j = 0; j < 4; j++) {
-                free(chunks[j]);
+    long deadline = now_us() + TIMEOUT_SEC * 1000000L;
+    int answered = 0;
+    while (answered < pending) {
+        long left = deadline - now_us();
+        if (left <= 0 || (poll(fds, pending, (left + 999) / 1000) < 0 && errno != EINTR)) break;
+        for (int p = 0; p < pending; p++) {
+            if (fds[p].fd < 0 || fds[p].revents == 0) continue;
+            dfs_frame response;
+            Server *server = &server_list->servers[index[p]];
+            if (recv_response(server, &response) < 0 || response.opcode != (OP_HELLO | DFS_RESPONSE) ||
+                response.status != ST_OK) {
+                text |= 1u << index[p];
             }
-            return;
+            fds[p].fd = -1;
+            answered++;
         }
     }
+    for (int p = 0; p < pending; p++) {
+        if (fds[p].fd >= 0) text |= 1u << index[p];
+    }
     
-    fclose(file);
-    
-    // calculate which server gets which chunk(hash)
-    unsigned int hash = get_file_hash(filename);
-    int x = hash % server_list->count;
-    printf("file %s maps to %d\n", filename, x);
-    
-    // check if enough servers are connected
-    int available_servers = 0;
+    // old servers; they may have half read the hello as a command line, so start over in text
     for (int i = 0; i < server_list->count; i++) {
-        if (server_list->servers[i].connected) {
-            available_servers++;
+        if (text >> i & 1) {
+            close(server_list->servers[i].socket);
+            server_list->servers[i].binary = 0;
         }
     }
+    if (text) {
+        connected = (connected & ~text) | dial_servers(server_list, text, text);
+    }
+    return connected;
+}
+
+// servers that didn't answer lately, from HEALTH_FILE in $HOME: one "<ip>:<port> <unix time>" line
+//each, the time being when a command last waited for the server in vain; down[i] gets that time, 0 if
+//the server isn't listed
+void health_load(ServerList *server_list, long *down) {
+    memset(down, 0, MAX_SERVERS * sizeof(long));
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), HEALTH_FILE);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return;
+    }
     
-    if (available_servers < 3) { //need at least 3
-        printf("%s put failed\n", filename);
-        for (int i = 0; i < 4; i++) {
-            free(chunks[i]);
+    char line[128];
+    while (fgets(line, sizeof(line), file)) {
+        char address[64];
+        long since;
+        if (sscanf(line, "%63s %ld", address, &since) != 2) continue;
+        for (int i = 0; i < server_list->count; i++) {
+            char own[64];
+            snprintf(own, sizeof(own), "%s:%d", server_list->servers[i].ip, server_list->servers[i].port);
+            if (strcmp(own, address) == 0) down[i] = since;
         }
+    }
+    fclose(file);
+}
+
+// write the servers still down back to HEALTH_FILE (through a temp file, other commands may be reading it)
+void health_save(ServerList *server_list, const long *down) {
+    char path[256];
+    char temp_path[272];
+    snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), HEALTH_FILE);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, getpid());
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
         return;
     }
     
-    // define chunk pairs
-    int chunk_pairs[4][2] = {
-        {0, 1}, {1, 2}, {2, 3}, {3, 0} 
-    };
-    
-    // adjust based on hash
-    for (int i = 0; i < x; i++) {
-        //rotate
-        int temp1 = chunk_pairs[0][0];
-        int temp2 = chunk_pairs[0][1];
-        
-        for (int j = 0; j < 3; j++) {
-            chunk_pairs[j][0] = chunk_pairs[j+1][0];
-            chunk_pairs[j][1] = chunk_pairs[j+1][1];
+    for (int i = 0; i < server_list->count; i++) {
+        if (down[i]) {
+            fprintf(file, "%s:%d %ld\n", server_list->servers[i].ip, server_list->servers[i].port, down[i]);
         }
-        
-        chunk_pairs[3][0] = temp1;
-        chunk_pairs[3][1] = temp2;
+    }
+    if (fclose(file) != 0 || rename(temp_path, path) < 0) {
+        unlink(temp_path);
+    }
+}
+
+// connect to available servers, all at once (see connect_servers)
+//a server that was waited for in vain less than HEALTH_RETRY_SEC ago is still dialed, but not waited
+//for: it is in if it answers while the others do, so a dead one doesn't hold up every command
+void connect_to_servers(ServerList *server_list) {
+    long down[MAX_SERVERS];
+    health_load(server_list, down);
+    long now = time(NULL);
+    unsigned all = 0, patient = 0;
+    for (int i = 0; i < server_list->count; i++) {
+        all |= 1u << i;
+        if (down[i] == 0 || now - down[i] >= HEALTH_RETRY_SEC) patient |= 1u << i;
     }
     
-    // send chunks to the servers
+    unsigned connected = connect_servers(server_list, all, patient);
+    int changed = 0;
     for (int i = 0; i < server_list->count; i++) {
-        if (!server_list->servers[i].connected) {
+        Server *server = &server_list->servers[i];
+        if (!(connected >> i & 1)) {
+            printf("server %s (%s:%d) not available%s\n", server->hostname, server->ip, server->port,
+                   patient >> i & 1 ? "" : " (down lately, not waited for)");
+            if (patient >> i & 1) {
+                down[i] = now;
+                changed = 1;
+            }
             continue;
         }
         
-        // send PUT command
-        char command[BUFFER_SIZE];
-        sprintf(command, "PUT %s %ld", filename, chunk_size);
-        send(server_list->servers[i].socket, command, strlen(command), 0);
-        
-        //send first chunk
-        char chunk_header[64];
-        sprintf(chunk_header, "CHUNK %d", chunk_pairs[i][0] + 1);
-        send(server_list->servers[i].socket, chunk_header, strlen(chunk_header), 0);
-        
-        send(server_list->servers[i].socket, chunks[chunk_pairs[i][0]], chunk_size, 0);
-        
-        //send second
-        sprintf(chunk_header, "CHUNK %d", chunk_pairs[i][1] + 1);
-        send(server_list->servers[i].socket, chunk_header, strlen(chunk_header), 0);
-        
-        send(server_list->servers[i].socket, chunks[chunk_pairs[i][1]], chunk_size, 0);
-        
-        // get acknowledgment
-        char buffer[BUFFER_SIZE];
-        int received = recv(server_list->servers[i].socket, buffer, BUFFER_SIZE, 0);
-        if (received > 0) {
-            buffer[received] = '\0';
-            if (strncmp(buffer, "OK", 2) == 0) {
-                printf("server %s: chunks %d and %d uploaded successfully\n", 
-                       server_list->servers[i].hostname, 
-                       chunk_pairs[i][0] + 1, 
-                       chunk_pairs[i][1] + 1);
-            } else {
-                printf("server %s: upload failed - %s\n", server_list->servers[i].hostname, buffer);
-            }
-        }
+        printf("connected to server %s (%s:%d)%s\n", server->hostname, server->ip, server->port,
+               server->binary ? "" : " [text protocol]");
+        changed |= down[i] != 0;
+        down[i] = 0;
     }
+    if (changed) {
+        health_save(server_list, down);
+    }
+}
+
+// binary request header + name; a payload of length bytes (PUT) must follow from the caller
+int send_request(Server *server, int opcode, const char *name, uint32_t chunk, uint64_t length, uint32_t *request_id) {
+    dfs_frame request;
+    memset(&request, 0, sizeof(request));
+    request.opcode = opcode;
+    request.chunk = chunk;
+    request.length = length;
+    return send_header(server, &request, name, request_id);
+}
+
+// send a request header the caller filled in (version, id and name length are set here) + name
+int send_header(Server *server, const dfs_frame *fields, const char *name, uint32_t *request_id) {
+    dfs_frame request = *fields;
+    request.version = DFS_VERSION;
+    request.request_id = ++server->next_id;
+    request.name_len = name ? strlen(name) : 0;
     
-    // free memory
-    for (int i = 0; i < 4; i++) {
-        free(chunks[i]);
+    char header[DFS_HEADER_SIZE + MAX_FILENAME];
+    if (request.name_len >= MAX_FILENAME) {
+        return -1;
     }
+    dfs_encode(&request, (unsigned char *)header);
+    memcpy(header + DFS_HEADER_SIZE, name, request.name_len);
     
-    printf("file %s uploaded successfully\n", filename);
+    if (request_id) *request_id = request.request_id;
+    return send_all(server->socket, header, DFS_HEADER_SIZE + request.name_len, NULL);
 }
 
-// check if there are enough chunks to reconstruct the file
-int check_file_completeness(ServerList *server_list, char *filename) {
-    int chunk_present[4] = {0, 0, 0, 0};
-    
-    // find where each chunk is
-    //which servers have which chunks
-    unsigned int hash = get_file_hash(filename);
-    int x = hash % server_list->count;
+// read one binary response header; its payload (response->length bytes) is left for the caller
+int recv_response(Server *server, dfs_frame *response) {
+    char header[DFS_HEADER_SIZE];
+    if (recv_all(server->socket, header, DFS_HEADER_SIZE, NULL) < 0 ||
+        dfs_decode((unsigned char *)header, response) < 0 || !(response->opcode & DFS_RESPONSE)) {
+        return -1;
+    }
     
-    // define chunk pairs for each server
-    int chunk_pairs[4][2] = {
-        {0, 1}, {1, 2}, {2, 3}, {3, 0} 
-    };
+    // replies don't carry a name, but skip one if a server sends it
+    char name[MAX_FILENAME];
+    if (response->name_len >= MAX_FILENAME || recv_all(server->socket, name, response->name_len, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// 1 if server holds any chunk of filename
+int server_check(Server *server, const char *filename) {
+    if (server->binary) {
+        dfs_frame response;
+        return send_request(server, OP_CHECK, filename, 0, 0, NULL) == 0 &&
+               recv_response(server, &response) == 0 && response.status == ST_OK;
+    }
     
- // adjust
-            for (int i = 0; i < x; i++) {
-                //rotate
-                int temp1 = chunk_pairs[0][0];
-                int temp2 = chunk_pairs[0][1];
-                
-                for (int j = 0; j < 3; j++) {
-                    chunk_pairs[j][0] = chunk_pairs[j+1][0];
-                    chunk_pairs[j][1] = chunk_pairs[j+1][1];
-                }
-                
-                chunk_pairs[3][0] = temp1;
-                chunk_pairs[3][1] = temp2;
-            }
+    // send CHECK cmd
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "CHECK %s\n", filename);
+    send(server->socket, command, strlen(command), 0);
     
-    // check available chunks
-    for (int i = 0; i < server_list->count; i++) {
-        if (server_list->servers[i].connected) {
-            // send CHECK cmd
-            char command[BUFFER_SIZE];
-            sprintf(command, "CHECK %s", filename);
-            send(server_list->servers[i].socket, command, strlen(command), 0);
-            
-            // receive response
-            char buffer[BUFFER_SIZE];
-            int received = recv(server_list->servers[i].socket, buffer, BUFFER_SIZE, 0);
-            if (received > 0) {
-                buffer[received] = '\0';
-                if (strncmp(buffer, "EXISTS", 6) == 0) {
-                    chunk_present[chunk_pairs[i][0]] = 1;
-                    chunk_present[chunk_pairs[i][1]] = 1;
-                }
-            }
+    // receive response
+    char buffer[BUFFER_SIZE];
+    int received = recv(server->socket, buffer, BUFFER_SIZE - 1, 0);
+    if (received > 0) {
+        buffer[received] = '\0';
+        return strncmp(buffer, "EXISTS", 6) == 0;
+    }
+    return 0;
+}
+
+// size of the chunks server holds of filename, 0 if none
+long server_size(Server *server, const char *filename) {
+    if (server->binary) {
+        dfs_frame response;
+        if (send_request(server, OP_SIZE, filename, 0, 0, NULL) == 0 &&
+            recv_response(server, &response) == 0 && response.status == ST_OK) {
+            return response.offset;
         }
+        return 0;
     }
     
-    // see if all chunks present
-    for (int i = 0; i < 4; i++) {
-        if (!chunk_present[i]) {
-            return 0;
+    // send SIZE command
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "SIZE %s\n", filename);
+    send(server->socket, command, strlen(command), 0);
+    
+    // get response
+    char buffer[BUFFER_SIZE];
+    int received = recv(server->socket, buffer, BUFFER_SIZE - 1, 0);
+    if (received > 0) {
+        buffer[received] = '\0';
+        if (strncmp(buffer, "SIZE ", 5) == 0) {
+            return atol(buffer + 5);
         }
     }
-    
-    return 1;
+    return 0;
+}
+
+// '\n' separated names on server (malloc'd, NULL on error)
+char *server_list_names(Server *server) {
+    if (server->binary) {
+        dfs_frame response;
+        if (send_request(server, OP_LIST, NULL, 0, 0, NULL) < 0 || recv_response(server, &response) < 0) {
+            return NULL;
+        }
+        char *names = malloc(response.length + 1);
+        if (!names || recv_all(server->socket, names, response.length, NULL) < 0 || response.status != ST_OK) {
+            free(names);
+            return NULL;
+        }
+        names[response.length] = '\0';
+        return names;
+    }
+    
+    // send LIST cmd
+    char command[] = "LIST\n";
+    send(server->socket, command, strlen(command), 0);
+    
+    // get response
+    char *buffer = malloc(BUFFER_SIZE);
+    int received = buffer ? recv(server->socket, buffer, BUFFER_SIZE - 1, 0) : -1;
+    if (received <= 0) {
+        free(buffer);
+        return NULL;
+    }
+    buffer[received] = '\0';
+    return buffer;
+}
+
+// hash the filename
+//for distributing chunks
+unsigned int get_file_hash(char *filename) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_CTX md5_context;
+    
+    MD5_Init(&md5_context);
+    MD5_Update(&md5_context, filename, strlen(filename));
+    MD5_Final(digest, &md5_context);
+    
+    // use first 4 bytes
+    unsigned int hash_value = 0;
+    memcpy(&hash_value, digest, sizeof(unsigned int));
+    
+    return hash_value;
+}
+
+// which two chunks each of the first 4 servers holds: the pairs (1,2) (2,3) (3,4) (4,1),
+//rotated by the filename hash
+void place_chunks(char *filename, int server_count, int chunk_pairs[4][2]) {
+    static const int base[4][2] = {
+        {0, 1}, {1, 2}, {2, 3}, {3, 0}
+    };
+    int x = get_file_hash(filename) % server_count;
+    for (int i = 0; i < 4; i++) {
+        chunk_pairs[i][0] = base[(i + x) % 4][0];
+        chunk_pairs[i][1] = base[(i + x) % 4][1];
+    }
+}
+
+// send everything, counting progress; 0 ok, -1 on error/timeout
+int send_all(int sock, const char *data, long len, atomic_long *progress) {
+    while (len > 0) {
+        ssize_t sent = send(sock, data, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+        if (progress) atomic_fetch_add(progress, sent);
+    }
+    return 0;
+}
+
+// receive exactly len bytes; 0 ok, -1 on error/timeout/close
+int recv_all(int sock, char *data, long len, atomic_long *progress) {
+    while (len > 0) {
+        ssize_t received = recv(sock, data, len, 0);
+        if (received <= 0) {
+            return -1;
+        }
+        data += received;
+        len -= received;
+        if (progress) atomic_fetch_add(progress, received);
+    }
+    return 0;
+}
+
+// stream len bytes of the file from start through mmap windows, one window mapped at a time
+//(replicas of a chunk share the same page cache pages); 0 ok, -1 on error
+int send_range(TransferJob *job, off_t start, long len, uint32_t *crc) {
+    long page = sysconf(_SC_PAGESIZE);
+    long sent = 0;
+    while (sent < len) {
+        off_t pos = start + sent;
+        off_t map_start = pos - (pos % page);
+        long skip = pos - map_start;
+        long span = job->window;
+        if (span > len - sent + skip) {
+            span = len - sent + skip;
+        }
+        
+        char *map = mmap(NULL, span, PROT_READ, MAP_SHARED, job->file_fd, map_start);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, span, MADV_SEQUENTIAL);
+        *crc = crc32c(*crc, map + skip, span - skip);
+        int rc = send_all(job->server->socket, map + skip, span - skip, &job->bytes_done);
+        munmap(map, span);
+        
+        if (rc < 0) {
+            return -1;
+        }
+        sent += span - skip;
+    }
+    return 0;
+}
+
+// compute parity shard `row` a stripe at a time from the k data shards and stream it
+//the window is split k+1 ways (k data reads + 1 parity), and data past a short last shard is zero
+int send_parity(TransferJob *job, int row, long len, uint32_t *crc) {
+    const rs_code *rs = job->rs;
+    long stripe = job->window / (rs->k + 1);
+    if (stripe < 4096) stripe = 4096;
+    
+    uint8_t *buf = malloc((rs->k + 1) * stripe);
+    if (!buf) {
+        return -1;
+    }
+    uint8_t *data[MAX_CHUNKS];
+    for (int i = 0; i < rs->k; i++) {
+        data[i] = buf + i * stripe;
+    }
+    uint8_t *parity = buf + rs->k * stripe;
+    
+    int rc = 0;
+    for (long pos = 0; rc == 0 && pos < len; pos += stripe) {
+        long span = len - pos < stripe ? len - pos : stripe;
+        for (int i = 0; i < rs->k && rc == 0; i++) {
+            long have = job->chunk_len[i] - pos;
+            have = have < 0 ? 0 : (have < span ? have : span);
+            if (have > 0 && pread(job->file_fd, data[i], have, (off_t)i * job->chunk_size + pos) != have) {
+                rc = -1;
+            }
+            memset(data[i] + have, 0, span - have);
+        }
+        if (rc == 0) {
+            rs_encode_row(rs, row, (const uint8_t *const *)data, parity, span);
+            *crc = crc32c(*crc, parity, span);
+            rc = send_all(job->server->socket, (char *)parity, span, &job->bytes_done);
+        }
+    }
+    
+    free(buf);
+    return rc;
+}
+
+// name and chunk number that chunk c of a job goes by on the wire: chunk c + 1 of the file, or for a
+//deduplicated file chunk 1 of the content chunk it is
+const char *wire_name(const TransferJob *job, int chunk, uint32_t *wire_chunk) {
+    if (job->wire) {
+        *wire_chunk = job->wire[chunk].chunk;
+        return job->wire[chunk].name;
+    }
+    *wire_chunk = job->names ? 1 : chunk + 1;
+    return job->names ? job->names[chunk] : job->filename;
+}
+
+// ask server for chunk c of a job: all of it, or a ranged piece's bytes of it
+//binary: GET, or READ with the byte count as payload; text: "GET <name> <n> [<from> <count>]", the
+//reply line is left to the caller. 0 ok, -1 if it couldn't be sent
+int send_get(Server *server, const TransferJob *job, const GetPiece *piece, int chunk, uint32_t *request_id) {
+    uint32_t wire_chunk;
+    const char *name = wire_name(job, chunk, &wire_chunk);
+    int ranged = piece && piece->ranged;
+    if (server->binary && !ranged) {
+        return send_request(server, OP_GET, name, wire_chunk, 0, request_id);
+    }
+    if (server->binary) {
+        dfs_frame request;
+        memset(&request, 0, sizeof(request));
+        request.opcode = OP_READ;
+        request.chunk = wire_chunk;
+        request.offset = piece->from;
+        request.length = 8;
+        unsigned char count[8];
+        dfs_put64(count, piece->bytes);
+        return send_header(server, &request, name, request_id) == 0 &&
+               send_all(server->socket, (char *)count, sizeof(count), NULL) == 0 ? 0 : -1;
+    }
+    
+    char command[BUFFER_SIZE];
+    if (ranged) {
+        snprintf(command, sizeof(command), "GET %s %u %ld %ld\n", name, wire_chunk, piece->from, piece->bytes);
+    } else {
+        snprintf(command, sizeof(command), "GET %s %u\n", name, wire_chunk);
+    }
+    return send_all(server->socket, command, strlen(command), NULL);
+}
+
+// text put acknowledgment for the job's chunks first..first+count-1: "OK <crc> <crc> ..." in chunk
+//order (older servers just say OK); marks the job failed on anything else
+void text_acks(TransferJob *job, int first, int count) {
+    char buffer[BUFFER_SIZE];
+    int received = recv(job->server->socket, buffer, BUFFER_SIZE - 1, 0);
+    if (received <= 0) {
+        snprintf(job->error, sizeof(job->error), "no acknowledgment");
+        job->failed = 1;
+        return;
+    }
+    buffer[received] = '\0';
+    if (strncasecmp(buffer, "OK", 2) != 0) {
+        snprintf(job->error, sizeof(job->error), "upload failed - %.100s", buffer);
+        job->failed = 1;
+    }
+    
+    char *p = buffer + 2;
+    for (int c = first; c < first + count && !job->failed; c++) {
+        char *end;
+        unsigned long stored = strtoul(p, &end, 16);
+        if (end == p) break;
+        if (stored != job->crc[c]) {
+            snprintf(job->error, sizeof(job->error), "chunk %d damaged on the way (sent %08x, stored %08lx)",
+                     job->chunks[c] + 1, job->crc[c], stored);
+            job->failed = 1;
+        }
+        p = end;
+    }
+}
+
+// upload this server's chunks straight from the file (or parity computed from it), then wait for its acks
+//text: one "PUT <name> <size> <count>" line, "CHUNK <n> <len>" + data per chunk, a single "OK" at the end
+//(content chunks and batched files have names of their own, so each is a one chunk PUT, acked before the next)
+//binary: a PUT frame per chunk sent back to back, acks collected afterwards by request id
+void *put_worker(void *arg) {
+    TransferJob *job = (TransferJob *)arg;
+    int sock = job->server->socket;
+    uint32_t ids[MAX_CHUNKS];
+    int own_names = job->names || job->wire;
+    
+    // send PUT command (older servers ignore the count and take two)
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "PUT %s %ld %d\n", job->filename, job->chunk_size, job->chunk_count);
+    if (!job->server->binary && !own_names && send_all(sock, command, strlen(command), NULL) < 0) {
+        snprintf(job->error, sizeof(job->error), "send failed");
+        job->failed = 1;
+        return NULL;
+    }
+    
+    for (int c = 0; c < job->chunk_count; c++) {
+        int chunk = job->chunks[c];
+        long len = job->chunk_len[chunk];
+        off_t offset = job->offsets[c];
+        uint32_t wire_chunk;
+        const char *name = wire_name(job, chunk, &wire_chunk);
+        if (job->pack && pack_wait(job->pack, chunk, &offset, &len) < 0) {
+            snprintf(job->error, sizeof(job->error), "chunk %d could not be compressed", chunk + 1);
+            job->failed = 1;
+            return NULL;
+        }
+        
+        int rc;
+        if (job->server->binary) {
+            rc = send_request(job->server, OP_PUT, name, wire_chunk, len, &ids[c]);
+        } else {
+            char chunk_header[BUFFER_SIZE];
+            if (own_names) {
+                snprintf(chunk_header, sizeof(chunk_header), "PUT %s %ld 1\nCHUNK %u %ld\n", name, len, wire_chunk, len);
+            } else {
+                snprintf(chunk_header, sizeof(chunk_header), "CHUNK %d %ld\n", chunk + 1, len);
+            }
+            rc = send_all(sock, chunk_header, strlen(chunk_header), NULL);
+        }
+        job->crc[c] = 0;
+        if (rc == 0) {
+            rc = job->rs && chunk >= job->rs->k ? send_parity(job, chunk, len, &job->crc[c])
+                                                : send_range(job, offset, len, &job->crc[c]);
+        }
+        if (job->pack) pack_release(job->pack, job->server_index, chunk);
+        if (rc < 0) {
+            snprintf(job->error, sizeof(job->error), "send of chunk %d failed", chunk + 1);
+            job->failed = 1;
+            return NULL;
+        }
+        if (!job->server->binary && own_names) {
+            text_acks(job, c, 1);
+            if (job->failed) return NULL;
+        }
+    }
+    
+    // get acknowledgments, in whatever order the server sends them
+    if (job->server->binary) {
+        for (int c = 0; c < job->chunk_count; c++) {
+            dfs_frame response;
+            if (recv_response(job->server, &response) < 0) {
+                snprintf(job->error, sizeof(job->error), "no acknowledgment");
+                job->failed = 1;
+                break;
+            }
+            for (int k = 0; k < job->chunk_count; k++) {
+                if (ids[k] == response.request_id && response.status != ST_OK) {
+                    snprintf(job->error, sizeof(job->error), "chunk %d rejected (status %d)",
+                             job->chunks[k] + 1, response.status);
+                    job->failed = 1;
+                } else if (ids[k] == response.request_id && (response.flags & DFS_FLAG_CHECKSUM) &&
+                           response.checksum != job->crc[k]) {
+                    snprintf(job->error, sizeof(job->error), "chunk %d damaged on the way (sent %08x, stored %08x)",
+                             job->chunks[k] + 1, job->crc[k], response.checksum);
+                    job->failed = 1;
+                }
+            }
+        }
+        return NULL;
+    }
+    
+    if (!own_names) {
+        text_acks(job, 0, job->chunk_count);
+    }
+    return NULL;
+}
+
+// download this server's assigned chunks, writing each window to its final offset as it lands
+//text: one GET at a time, each reply is "DATA <len> [crc]\n" + bytes, or "ERROR ...\n"
+//binary: every GET is sent up front and replies are matched to chunks by request id
+//a chunk the server doesn't have or that fails its checksum is marked bad and the rest carry on;
+//a broken transfer (or one cut short because a hedge won) marks everything still outstanding bad
+//and drops the connection. with its own chunks in (all batches of a streamed job's), the job goes on
+//to hedge for slower ones
+//compressed chunks are decoded a block at a time on the way in, so they land in place already raw
+void *get_worker(void *arg) {
+    TransferJob *job = (TransferJob *)arg;
+    Server *server = job->server;
+    int sock = server->socket;
+    uint32_t ids[MAX_CHUNKS];
+    int complete[MAX_CHUNKS] = {0};
+    GetPiece *pieces[MAX_CHUNKS];
+    int broken = 0;
+    int n = 0;
+    
+    for (int c = 0; c < job->chunk_count; c++) {
+        pieces[c] = job->piece_index ? &job->pieces[job->piece_index[c]] : NULL;
+        for (int p = 0; p < job->piece_count && !job->piece_index; p++) {
+            if (job->pieces[p].server == job->server_index && job->pieces[p].chunk == job->chunks[c]) {
+                pieces[c] = &job->pieces[p];
+            }
+        }
+    }
+    
+    char *window = malloc(job->window);
+    if (!window) {
+        snprintf(job->error, sizeof(job->error), "memory allocation failed");
+        broken = 1;
+    }
+    
+    for (int c = 0; c < job->chunk_count && server->binary && !broken; c++) {
+        if (send_get(server, job, pieces[c], job->chunks[c], &ids[c]) < 0) {
+            snprintf(job->error, sizeof(job->error), "chunk %d request failed", job->chunks[c] + 1);
+            broken = 1;
+        }
+    }
+    
+    for (n = 0; n < job->chunk_count && !broken; n++) {
+        int piece = n;
+        int chunk = job->chunks[n];
+        long len = -1;
+        uint32_t expect = 0;
+        int checked = 0;
+        
+        // the server answers in order, so this is the one it is working on now
+        long zero = 0;
+        if (pieces[n]) atomic_compare_exchange_strong(&pieces[n]->started_us, &zero, now_us());
+        
+        if (server->binary) {
+            dfs_frame response;
+            int c = -1;
+            if (recv_response(server, &response) == 0) {
+                for (c = job->chunk_count - 1; c >= 0 && ids[c] != response.request_id; c--);
+            }
+            if (c < 0) {
+                snprintf(job->error, sizeof(job->error), "lost track of replies");
+                broken = 1;
+                break;
+            }
+            piece = c;
+            chunk = job->chunks[c];
+            if (response.status != ST_OK) {
+                snprintf(job->error, sizeof(job->error), "chunk %d not found", chunk + 1);
+                job->bad[piece] = 1;
+                if (pieces[piece]) atomic_store(&pieces[piece]->active, 0);
+                continue;
+            }
+            len = response.length;
+            expect = response.checksum;
+            checked = (response.flags & DFS_FLAG_CHECKSUM) != 0;
+        } else {
+            char reply[64];
+            if (send_get(server, job, pieces[piece], chunk, NULL) < 0 || recv_line(sock, reply, sizeof(reply)) < 0) {
+                snprintf(job->error, sizeof(job->error), "chunk %d request failed", chunk + 1);
+                broken = 1;
+                break;
+            }
+            int fields = sscanf(reply, "DATA %ld %x", &len, &expect);
+            if (fields < 1) {
+                snprintf(job->error, sizeof(job->error), "chunk %d not found", chunk + 1);
+                job->bad[piece] = 1;
+                if (pieces[piece]) atomic_store(&pieces[piece]->active, 0);
+                continue;
+            }
+            checked = fields == 2;
+        }
+        int ranged = pieces[piece] && pieces[piece]->ranged;
+        if (len < 0 || len > job->chunk_size || (ranged && len != pieces[piece]->bytes)) {
+            snprintf(job->error, sizeof(job->error), "chunk %d has a bad length (%ld)", chunk + 1, len);
+            broken = 1;
+            break;
+        }
+        
+        // each window goes in under the piece's lock, so a hedge that has taken it over can't be overwritten
+        GetPiece *shared = pieces[piece];
+        off_t offset = job->offsets[piece];
+        ChunkSink sink;
+        if (job->codec && sink_open(&sink, job->file_fd, offset) < 0) {
+            snprintf(job->error, sizeof(job->error), "memory allocation failed");
+            broken = 1;
+            break;
+        }
+        long done = 0;
+        uint32_t crc = 0;
+        int lost = 0;
+        while (done < len) {
+            ssize_t received = recv(sock, window, len - done < job->window ? len - done : job->window, 0);
+            if (received <= 0) {
+                break;
+            }
+            long decoded = job->codec ? sink.done : 0;
+            if (shared) pthread_mutex_lock(&shared->lock);
+            lost = shared && shared->won == 2;
+            int written = !lost && (job->codec ? sink_write(&sink, window, received) == 0
+                                               : pwrite(job->file_fd, window, received, offset + done) == received);
+            if (shared) pthread_mutex_unlock(&shared->lock);
+            if (!written) {
+                break;
+            }
+            crc = crc32c(crc, window, received);
+            done += received;
+            atomic_fetch_add(&job->bytes_done, job->codec ? sink.done - decoded : received);
+        }
+        long raw = job->codec ? sink.done : len;
+        int decodes = !job->codec || sink_close(&sink) == 0;
+        if (done < len) {
+            snprintf(job->error, sizeof(job->error), "chunk %d transfer failed at byte %ld", chunk + 1, done);
+            broken = 1;
+            break;
+        }
+        complete[piece] = 1;
+        if (checked && crc != expect) {
+            snprintf(job->error, sizeof(job->error), "chunk %d failed its checksum (got %08x, expected %08x)",
+                     chunk + 1, crc, expect);
+            job->bad[piece] = 1;
+            if (shared) atomic_store(&shared->active, 0);
+            continue;
+        }
+        if (!decodes) {
+            snprintf(job->error, sizeof(job->error), "chunk %d doesn't decompress", chunk + 1);
+            job->bad[piece] = 1;
+            if (shared) atomic_store(&shared->active, 0);
+            continue;
+        }
+        job->chunk_len[chunk] = raw;
+        
+        // first intact copy wins; a hedge still running for it is cut off
+        if (shared) {
+            note_read(server, raw, now_us() - atomic_load(&shared->started_us));
+            pthread_mutex_lock(&shared->lock);
+            if (shared->won == 0) {
+                shared->won = 1;
+                if (shared->hedge_sock >= 0) shutdown(shared->hedge_sock, SHUT_RDWR);
+            }
+            pthread_mutex_unlock(&shared->lock);
+            atomic_store(&shared->active, 0);
+        }
+    }
+    
+    // cut off by a hedge that won the chunk it was on (any piece, the server answers in order)
+    if (broken && n < job->chunk_count && pieces[n]) {
+        pthread_mutex_lock(&pieces[n]->lock);
+        if (pieces[n]->won == 2) {
+            snprintf(job->error, sizeof(job->error), "chunk %d came sooner from another replica, dropped",
+                     job->chunks[n] + 1);
+            job->cut_off = 1;
+        }
+        pthread_mutex_unlock(&pieces[n]->lock);
+    }
+    
+    // the socket itself is closed once the round is over; a hedge may still shut it down until then
+    if (broken) {
+        for (int c = 0; c < job->chunk_count; c++) {
+            job->bad[c] |= !complete[c];
+            if (pieces[c]) atomic_store(&pieces[c]->active, 0);
+        }
+        shutdown(sock, SHUT_RDWR);
+        server->connected = 0;
+    } else if (window && hedge_percentile > 0 && !job->more) {
+        hedge_idle(job, window);
+    }
+    for (int c = 0; c < job->chunk_count; c++) {
+        job->failed |= job->bad[c];
+    }
+    free(window);
+    return NULL;
+}
+
+// monotonic clock in microseconds
+long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// an intact chunk read of bytes took elapsed_us (from the server starting on it to the last byte)
+void note_read(Server *server, long bytes, long elapsed_us) {
+    if (bytes <= 0 || elapsed_us <= 0) {
+        return;
+    }
+    double rate = bytes / (elapsed_us / 1e6);
+    pthread_mutex_lock(&read_sample_lock);
+    read_samples[read_sample_count++ % HEDGE_SAMPLES] = elapsed_us / 1e6 / bytes;
+    server->rate = server->rate > 0 ? 0.7 * server->rate + 0.3 * rate : rate;
+    pthread_mutex_unlock(&read_sample_lock);
+}
+
+// how long a read of bytes may run before it is hedged: the hedge percentile of recent reads, scaled
+//to its size; -1 until there are two reads to go by
+long hedge_delay_us(long bytes) {
+    double sorted[HEDGE_SAMPLES];
+    pthread_mutex_lock(&read_sample_lock);
+    int count = read_sample_count < HEDGE_SAMPLES ? read_sample_count : HEDGE_SAMPLES;
+    memcpy(sorted, read_samples, count * sizeof(double));
+    pthread_mutex_unlock(&read_sample_lock);
+    if (count < 2) {
+        return -1;
+    }
+    
+    // insertion sort, there are at most HEDGE_SAMPLES
+    for (int i = 1; i < count; i++) {
+        double v = sorted[i];
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > v; j--) sorted[j] = sorted[j - 1];
+        sorted[j] = v;
+    }
+    int rank = (hedge_percentile * count + 99) / 100;
+    long delay = (long)(sorted[rank > 0 ? rank - 1 : 0] * bytes * 1e6);
+    return delay < HEDGE_MIN_MS * 1000 ? HEDGE_MIN_MS * 1000 : delay;
+}
+
+// observed read rate of a server; one not read from yet is assumed as fast as the best so far
+double read_rate(ServerList *server_list, int index) {
+    double best = 0;
+    pthread_mutex_lock(&read_sample_lock);
+    double rate = server_list->servers[index].rate;
+    for (int i = 0; i < server_list->count; i++) {
+        if (server_list->servers[i].rate > best) best = server_list->servers[i].rate;
+    }
+    pthread_mutex_unlock(&read_sample_lock);
+    return rate > 0 ? rate : (best > 0 ? best : DEFAULT_RATE);
+}
+
+// copy len bytes within fd from one offset to another, in the kernel where it can
+int copy_region(int fd, off_t from, off_t to, long len, char *buf, long buf_len) {
+    while (len > 0) {
+        ssize_t copied = copy_file_range(fd, &from, fd, &to, len, 0);
+        if (copied <= 0) {
+            break;
+        }
+        len -= copied;
+    }
+    while (len > 0) {
+        ssize_t got = pread(fd, buf, len < buf_len ? len : buf_len, from);
+        if (got <= 0 || pwrite(fd, buf, got, to) != got) {
+            return -1;
+        }
+        from += got;
+        to += got;
+        len -= got;
+    }
+    return 0;
+}
+
+// start decoding a compressed chunk into fd at offset; -1 if out of memory
+int sink_open(ChunkSink *sink, int fd, off_t offset) {
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = fd;
+    sink->offset = offset;
+    sink->in = malloc(DFS_BLOCK_HEADER + DFS_BLOCK_SIZE);
+    sink->out = malloc(DFS_BLOCK_SIZE);
+    if (!sink->in || !sink->out) {
+        free(sink->in);
+        free(sink->out);
+        return -1;
+    }
+    return 0;
+}
+
+// feed the next len bytes of the chunk, writing out every block they complete; -1 if a write failed
+//(a block that doesn't decode only marks the sink malformed, the rest of the chunk is still taken in)
+int sink_write(ChunkSink *sink, const char *data, long len) {
+    while (len > 0 && !sink->malformed) {
+        long need = DFS_BLOCK_HEADER;
+        uint32_t raw = 0, stored = 0;
+        if (sink->have >= DFS_BLOCK_HEADER) {
+            raw = dfs_get32(sink->in);
+            stored = dfs_get32(sink->in + 4);
+            long stored_len = stored & ~DFS_BLOCK_RAW;
+            if (raw == 0 || raw > DFS_BLOCK_SIZE || stored_len == 0 || stored_len > DFS_BLOCK_SIZE ||
+                ((stored & DFS_BLOCK_RAW) && stored_len != raw)) {
+                sink->malformed = 1;
+                break;
+            }
+            need += stored_len;
+        }
+        long take = need - sink->have < len ? need - sink->have : len;
+        memcpy(sink->in + sink->have, data, take);
+        sink->have += take;
+        data += take;
+        len -= take;
+        if (need == DFS_BLOCK_HEADER || sink->have < need) {
+            continue;
+        }
+        
+        const uint8_t *block = sink->in + DFS_BLOCK_HEADER;
+        if (!(stored & DFS_BLOCK_RAW)) {
+            if (lz_decompress(block, need - DFS_BLOCK_HEADER, sink->out, DFS_BLOCK_SIZE) != (int)raw) {
+                sink->malformed = 1;
+                break;
+            }
+            block = sink->out;
+        }
+        if (pwrite(sink->fd, block, raw, sink->offset + sink->done) != (ssize_t)raw) {
+            return -1;
+        }
+        sink->done += raw;
+        sink->have = 0;
+    }
+    return 0;
+}
+
+// done with a chunk; 0 if it decoded cleanly and ended on a block boundary
+int sink_close(ChunkSink *sink) {
+    free(sink->in);
+    free(sink->out);
+    return sink->malformed || sink->have != 0 ? -1 : 0;
+}
+
+// decode len compressed bytes at `from` in fd to `to`, raw set to the decoded length; 0 ok, -1 on error
+int unpack_region(int fd, off_t from, long len, off_t to, char *buf, long buf_len, long *raw) {
+    ChunkSink sink;
+    if (sink_open(&sink, fd, to) < 0) {
+        return -1;
+    }
+    int rc = 0;
+    for (long pos = 0; rc == 0 && pos < len; ) {
+        ssize_t got = pread(fd, buf, len - pos < buf_len ? len - pos : buf_len, from + pos);
+        if (got <= 0 || sink_write(&sink, buf, got) < 0) {
+            rc = -1;
+        }
+        pos += got;
+    }
+    *raw = sink.done;
+    return sink_close(&sink) < 0 ? -1 : rc;
+}
+
+// ask this job's server for a piece another server is slow with, on a connection of its own
+//the copy lands in the piece's spare slot and is moved (or decoded) into place only if it arrives intact
+//before the owner's, whose connection is then shut down. 1 if the hedge won
+int hedge_piece(TransferJob *job, GetPiece *piece, char *window) {
+    Server side = *job->server;
+    side.next_id = 0;
+    side.socket = dial(&side);
+    if (side.socket < 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&piece->lock);
+    int late = piece->won != 0;
+    if (!late) piece->hedge_sock = side.socket;
+    pthread_mutex_unlock(&piece->lock);
+    
+    long len = -1;
+    uint32_t expect = 0;
+    int checked = 0;
+    if (late) {
+        // the owner's copy got in meanwhile
+    } else if (side.binary) {
+        dfs_frame response;
+        if (send_get(&side, job, piece, piece->chunk, NULL) == 0 &&
+            recv_response(&side, &response) == 0 && response.status == ST_OK) {
+            len = response.length;
+            expect = response.checksum;
+            checked = (response.flags & DFS_FLAG_CHECKSUM) != 0;
+        }
+    } else {
+        char reply[64];
+        if (send_get(&side, job, piece, piece->chunk, NULL) == 0 && recv_line(side.socket, reply, sizeof(reply)) >= 0) {
+            int fields = sscanf(reply, "DATA %ld %x", &len, &expect);
+            checked = fields == 2;
+        }
+    }
+    
+    off_t spare = job->spare + (piece - job->pieces) * job->chunk_size;
+    long done = 0;
+    uint32_t crc = 0;
+    if (len > job->chunk_size || (piece->ranged && len != piece->bytes)) {
+        len = -1;
+    }
+    while (done < len) {
+        ssize_t received = recv(side.socket, window, len - done < job->window ? len - done : job->window, 0);
+        if (received <= 0 || pwrite(job->file_fd, window, received, spare + done) != received) {
+            break;
+        }
+        crc = crc32c(crc, window, received);
+        done += received;
+    }
+    
+    int won = 0;
+    long raw = len;
+    pthread_mutex_lock(&piece->lock);
+    piece->hedge_sock = -1;
+    if (len >= 0 && done == len && (!checked || crc == expect) && piece->won == 0 &&
+        (job->codec ? unpack_region(job->file_fd, spare, len, piece->offset, window, job->window, &raw)
+                    : copy_region(job->file_fd, spare, piece->offset, len, window, job->window)) == 0) {
+        piece->won = 2;
+        job->chunk_len[piece->chunk] = raw;
+        won = 1;
+    }
+    pthread_mutex_unlock(&piece->lock);
+    close(side.socket);
+    
+    if (won) {
+        shutdown(piece->owner_sock, SHUT_RDWR);
+    }
+    return won;
+}
+
+// with its own chunks in, a job hedges for the rest of the round: a piece its server also holds that
+//has been with its owner past the hedge delay gets a duplicate request from here, one per piece.
+//returns once no piece is left that it could still help with
+void hedge_idle(TransferJob *job, char *window) {
+    while (1) {
+        GetPiece *pick = NULL;
+        long age = 0;
+        int waiting = 0;
+        long now = now_us();
+        
+        for (int p = 0; p < job->piece_count; p++) {
+            GetPiece *piece = &job->pieces[p];
+            if (piece->server < 0 || piece->server == job->server_index || !atomic_load(&piece->active) ||
+                atomic_load(&piece->owner->finished) || atomic_load(&piece->hedged) || (piece->tried >> job->server_index & 1)) {
+                continue;
+            }
+            int holds = 0;
+            for (int s = 0; s < piece->source_count; s++) {
+                holds |= piece->sources[s] == job->server_index;
+            }
+            if (!holds) {
+                continue;
+            }
+            
+            waiting = 1;
+            long started = atomic_load(&piece->started_us);
+            long delay = hedge_delay_us(piece->bytes);
+            if (!pick && started > 0 && delay >= 0 && now - started > delay) {
+                pick = piece;
+                age = now - started;
+            }
+        }
+        
+        if (pick && atomic_exchange(&pick->hedged, 1) == 0) {
+            pick->hedge_server = job->server_index;
+            pick->hedge_after_us = age;
+            hedge_piece(job, pick, window);
+        } else if (!waiting) {
+            return;
+        } else {
+            usleep(HEDGE_POLL_MS * 1000);
+        }
+    }
+}
+
+// a streamed job: its server's queue goes through the batch worker (put_worker or get_worker) MAX_CHUNKS
+//at a time on this one thread and connection, so a server with a bigger share carries straight on
+//instead of waiting for the other servers at every MAX_CHUNKS. a get batch that broke the connection,
+//or a put batch that failed, ends the stream, and the rest of the queue is marked bad with it
+void *stream_worker(void *arg) {
+    TransferJob *job = (TransferJob *)arg;
+    ChunkQueue *queue = job->queue;
+    int failed = 0;
+    char error[sizeof(job->error)] = "";
+    int q = 0;
+    while (q < queue->count && job->server->connected && !(failed && !job->pieces)) {
+        int n = queue->count - q < MAX_CHUNKS ? queue->count - q : MAX_CHUNKS;
+        memcpy(job->chunks, queue->chunks + q, n * sizeof(int));
+        memcpy(job->offsets, queue->offsets + q, n * sizeof(off_t));
+        memset(job->bad, 0, sizeof(job->bad));
+        job->chunk_count = n;
+        job->piece_index = job->pieces ? queue->piece + q : NULL;
+        job->more = q + n < queue->count;
+        job->failed = 0;
+        queue->batch(job);
+        
+        for (int k = 0; k < n; k++) {
+            queue->bad[q + k] = job->pieces ? job->bad[k] : job->failed;
+        }
+        if (job->failed) {
+            failed = 1;
+            memcpy(error, job->error, sizeof(error));
+        }
+        q += n;
+    }
+    
+    // what never got its turn; a hedge needn't wait for it either
+    for (; q < queue->count; q++) {
+        queue->bad[q] = 1;
+        if (job->pieces) atomic_store(&job->pieces[queue->piece[q]].active, 0);
+        failed = 1;
+    }
+    job->failed = failed;
+    if (error[0]) memcpy(job->error, error, sizeof(error));
+    return NULL;
+}
+
+// thread entry: run the job's worker and flag it as finished for the progress loop
+void *transfer_thread(void *arg) {
+    TransferJob *job = (TransferJob *)arg;
+    job->worker(job);
+    atomic_store(&job->finished, 1);
+    return NULL;
+}
+
+// run one worker thread per job, show progress, report per server
+// returns number of failed servers
+int run_transfers(TransferJob *jobs, int job_count, void *(*worker)(void *), const char *verb) {
+    pthread_t threads[MAX_SERVERS];
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    
+    for (int i = 0; i < job_count; i++) {
+        atomic_init(&jobs[i].bytes_done, 0);
+        atomic_init(&jobs[i].finished, 0);
+        jobs[i].worker = worker;
+        if (pthread_create(&threads[i], NULL, transfer_thread, &jobs[i]) != 0) {
+            snprintf(jobs[i].error, sizeof(jobs[i].error), "could not start thread");
+            jobs[i].failed = 1;
+            atomic_store(&jobs[i].finished, 1);
+            threads[i] = 0;
+        }
+    }
+    
+    // progress while anything is still moving (terminal only, and only one transfer at a time)
+    int interactive = show_progress && isatty(STDOUT_FILENO);
+    while (interactive) {
+        long done = 0, total = 0;
+        for (int i = 0; i < job_count; i++) {
+            done += atomic_load(&jobs[i].bytes_done);
+            total += jobs[i].bytes_total;
+        }
+        printf("\r%sing: %ld/%ld bytes", verb, done, total);
+        for (int i = 0; i < job_count; i++) {
+            printf("  %s %ld%%", jobs[i].server->hostname,
+                   jobs[i].bytes_total ? atomic_load(&jobs[i].bytes_done) * 100 / jobs[i].bytes_total : 100);
+        }
+        fflush(stdout);
+        
+        int running = 0;
+        for (int i = 0; i < job_count; i++) running += !atomic_load(&jobs[i].finished);
+        if (running == 0) break;
+        usleep(PROGRESS_MS * 1000);
+    }
+    if (interactive) printf("\n");
+    
+    int failures = 0;
+    for (int i = 0; i < job_count; i++) {
+        if (threads[i]) pthread_join(threads[i], NULL);
+        gettimeofday(&now, NULL);
+        double seconds = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1e6;
+        
+        // "1", "1 and 2", "1, 3 and 5"
+        char chunk_list[8 * MAX_CHUNKS] = "";
+        for (int c = 0, used = 0; c < jobs[i].chunk_count && used < (int)sizeof(chunk_list); c++) {
+            const char *sep = c == 0 ? "" : (c == jobs[i].chunk_count - 1 ? " and " : ", ");
+            used += snprintf(chunk_list + used, sizeof(chunk_list) - used, "%s%d", sep, jobs[i].chunks[c] + 1);
+        }
+        
+        if (jobs[i].failed) {
+            failures++;
+            printf("server %s: %s failed - %s\n", jobs[i].server->hostname, verb, jobs[i].error);
+        } else if (jobs[i].queue) {
+            long bytes = atomic_load(&jobs[i].bytes_done);
+            printf("server %s: %d chunks %sed (%ld bytes, %.1f MB/s)\n", jobs[i].server->hostname,
+                   jobs[i].queue->count, verb, bytes, seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+        } else if (jobs[i].wire) {
+            long bytes = atomic_load(&jobs[i].bytes_done);
+            printf("server %s: %d chunks of a batch %sed (%ld bytes, %.1f MB/s)\n", jobs[i].server->hostname,
+                   jobs[i].chunk_count, verb, bytes, seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+        } else {
+            long bytes = atomic_load(&jobs[i].bytes_done);
+            printf("server %s: chunk%s %s %sed (%ld bytes, %.1f MB/s)\n", jobs[i].server->hostname,
+                   jobs[i].chunk_count > 1 ? "s" : "", chunk_list, verb, bytes,
+                   seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+        }
+    }
+    
+    return failures;
+}
+
+// implementing PUT command
+void put_file(ServerList *server_list, char *filename) {
+    // check if file exists & readable
+    int file_fd = open(filename, O_RDONLY);
+    if (file_fd < 0) {
+        perror("Error opening file");
+        return;
+    }
+    
+    // get file size
+    struct stat st;
+    if (fstat(file_fd, &st) < 0) {
+        perror("Error reading file size");
+        close(file_fd);
+        return;
+    }
+    long file_size = st.st_size;
+    
+    if (dedup_avg > 0) {
+        put_dedup(server_list, filename, file_fd, file_size);
+        close(file_fd);
+        return;
+    }
+    if (ec_data > 0) {
+        put_erasure(server_list, filename, file_fd, file_size);
+        close(file_fd);
+        return;
+    }
+    
+    put_striped(server_list, filename, file_fd, file_size);
+    close(file_fd);
+}
+
+// check if there are enough chunks to reconstruct the file
+int check_file_completeness(ServerList *server_list, char *filename) {
+    int chunk_present[4] = {0, 0, 0, 0};
+    
+    // find where each chunk is
+    //which servers have which chunks
+    int chunk_pairs[4][2];
+    place_chunks(filename, server_list->count, chunk_pairs);
+    
+    // check available chunks
+    for (int i = 0; i < server_list->count; i++) {
+        if (server_list->servers[i].connected && server_check(&server_list->servers[i], filename)) {
+            chunk_present[chunk_pairs[i][0]] = 1;
+            chunk_present[chunk_pairs[i][1]] = 1;
+        }
+    }
+    
+    // see if all chunks present
+    for (int i = 0; i < 4; i++) {
+        if (!chunk_present[i]) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+// implememt GET command
+void get_file(ServerList *server_list, char *filename) {
+    // files with a layout record say how they were stored; the rest are 4 chunks x 2 replicas
+    dfs_layout layout;
+    if (fetch_layout(server_list, filename, &layout) == 0) {
+        if (layout.scheme == LAYOUT_ERASURE) {
+            get_erasure(server_list, filename, &layout);
+        } else if (layout.scheme == LAYOUT_DEDUP) {
+            get_dedup(server_list, filename, &layout);
+        } else {
+            get_striped(server_list, filename, &layout);
+        }
+        return;
+    }
+    
+    // check if enough chunks to reconstruct the file
+    if (!check_file_completeness(server_list, filename)) {
+        printf("%s is incomplete\n", filename);
+        return;
+    }
+    
+    int chunk_pairs[4][2];
+    place_chunks(filename, server_list->count, chunk_pairs);
+    
+    // get chunk size
+    //largest chunk any server reports (the last chunk can be short)
+    long chunk_size = 0;
+    for (int i = 0; i < server_list->count; i++) {
+        if (server_list->servers[i].connected) {
+            long size = server_size(&server_list->servers[i], filename);
+            if (size > chunk_size) {
+                chunk_size = size;
+            }
+        }
+    }
+    
+    if (chunk_size == 0) {
+        printf("error: could not determine chunk size\n");
+        return;
+    }
+    
+    // output goes to a temp file next to the target, renamed once complete
+    char part_path[MAX_FILENAME + 16];
+    snprintf(part_path, sizeof(part_path), "%s.part", filename);
+    int output_fd = open(part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        perror("error creating output file");
+        return;
+    }
+    
+    // reserve the space up front so out of order writes don't fragment it
+    if (fallocate(output_fd, FALLOC_FL_KEEP_SIZE, 0, 4 * chunk_size) < 0 && errno != EOPNOTSUPP) {
+        perror("could not preallocate output file");
+    }
+    
+    // retrieve chunks from servers, all at once
+    //both holders of a chunk are sources, the server that has it as its first chunk listed first
+    //(fetch_pieces spreads them by queue depth, so every server serves one chunk when all are up)
+    GetPiece pieces[4];
+    long chunk_len[4] = {0, 0, 0, 0};
+    for (int c = 0; c < 4; c++) {
+        GetPiece *piece = &pieces[c];
+        memset(piece, 0, sizeof(*piece));
+        piece->chunk = c;
+        piece->offset = (off_t)c * chunk_size;
+        piece->bytes = chunk_size;
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < server_list->count && i < 4; i++) {
+                if (chunk_pairs[i][pass] == c) {
+                    piece->sources[piece->source_count++] = i;
+                }
+            }
+        }
+    }
+    
+    if (fetch_pieces(server_list, filename, output_fd, chunk_len, chunk_size, pieces, 4, NULL, CODEC_NONE) < 0) {
+        printf("%s download failed: no intact copy of some chunk left\n", filename);
+        close(output_fd);
+        unlink(part_path);
+        return;
+    }
+    
+    // trim to the real length (end of the last chunk) and put it in place
+    off_t file_size = 0;
+    for (int i = 0; i < 4; i++) {
+        if (chunk_len[i] > 0) {
+            file_size = (off_t)i * chunk_size + chunk_len[i];
+        }
+    }
+    if (finish_part(output_fd, part_path, filename, file_size) == 0) {
+        printf("file %s downloaded successfully\n", filename);
+    }
+}
+
+// put or get files, parallel_files at a time (see FileQueue); a worker past the first gets its own
+//connections, to the servers the command itself reached, and a share of the buffer budget
+//with more than one worker the per transfer progress lines would overwrite each other, so they are off
+void run_files(ServerList *server_list, char **files, int count, int put) {
+    if (count == 0) {
+        return;
+    }
+    
+    FileQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.config = server_list;
+    queue.files = files;
+    queue.count = count;
+    queue.put = put;
+    queue.sizes = malloc(count * sizeof(long));
+    queue.servers = malloc(count * sizeof(unsigned));
+    queue.taken = calloc(count, 1);
+    // deduplicated puts go one at a time, so each finds the chunks the ones before it stored
+    int worker_count = parallel_files < count ? parallel_files : count;
+    if (put && dedup_avg > 0) {
+        worker_count = 1;
+    }
+    FileWorker *workers = malloc(worker_count * sizeof(FileWorker));
+    if (!queue.sizes || !queue.servers || !queue.taken || !workers) {
+        perror("error scheduling files");
+        free(queue.sizes);
+        free(queue.servers);
+        free(queue.taken);
+        free(workers);
+        return;
+    }
+    
+    for (int f = 0; f < count; f++) {
+        struct stat st;
+        queue.sizes[f] = put && stat(files[f], &st) == 0 ? st.st_size : -1;
+        queue.servers[f] = file_servers(&queue, f, NULL);
+    }
+    queue.per_server = parallel_files / 2 > 1 ? parallel_files / 2 : 1;
+    queue.batch_max = (count + worker_count - 1) / worker_count;
+    pthread_mutex_init(&queue.lock, NULL);
+    if (dedup_avg > 0) {
+        gear_init();
+    }
+    
+    unsigned reached = 0;
+    for (int i = 0; i < server_list->count; i++) {
+        reached |= (unsigned)server_list->servers[i].connected << i;
+    }
+    long budget = buffer_budget;
+    buffer_budget = budget / worker_count > 64 * 1024 ? budget / worker_count : 64 * 1024;
+    show_progress = worker_count == 1;
+    pthread_t threads[MAX_PARALLEL_FILES];
+    int started = 0;
+    for (int w = 0; w < worker_count; w++) {
+        workers[w].queue = &queue;
+        workers[w].servers = server_list;
+        if (w == 0) continue;
+        
+        workers[w].own = *server_list;
+        workers[w].servers = &workers[w].own;
+        connect_servers(&workers[w].own, reached, reached);
+        if (pthread_create(&threads[started], NULL, file_worker, &workers[w]) != 0) {
+            for (int i = 0; i < workers[w].own.count; i++) {
+                if (workers[w].own.servers[i].connected) close(workers[w].own.servers[i].socket);
+            }
+            break;
+        }
+        started++;
+    }
+    file_worker(&workers[0]);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    for (int w = 1; w <= started; w++) {
+        for (int i = 0; i < workers[w].own.count; i++) {
+            if (workers[w].own.servers[i].connected) close(workers[w].own.servers[i].socket);
+        }
+    }
+    buffer_budget = budget;
+    show_progress = 1;
+    
+    pthread_mutex_destroy(&queue.lock);
+    free(queue.sizes);
+    free(queue.servers);
+    free(queue.taken);
+    free(workers);
+}
+
+// servers a file's transfer uses, as a bitmask: where a replicated put places its chunks, every
+//connected server otherwise. a get doesn't know the layout before it starts (reading every file's
+//record up front would cost a round trip to each server per file), so gets all count against every
+//server and queue_take hands them out oldest first
+//entries, if given, gets each server's share of a batch added: its chunks plus a layout record
+unsigned file_servers(FileQueue *queue, int file, int *entries) {
+    ServerList *server_list = queue->config;
+    unsigned mask = 0;
+    if (!queue->put || queue->sizes[file] < 0 || ec_data > 0 || dedup_avg > 0) {
+        for (int i = 0; i < server_list->count; i++) {
+            if (server_list->servers[i].connected) mask |= 1u << i;
+        }
+        return mask;
+    }
+    
+    dfs_layout layout;
+    plan_layout(queue->sizes[file], server_list->count, &layout);
+    for (int c = 0; c < layout.data_chunks; c++) {
+        for (int r = 0; r < layout.replicas; r++) {
+            int i = layout_server(&layout, server_list, queue->files[file], c, r);
+            if (!server_list->servers[i].connected) continue;
+            mask |= 1u << i;
+            if (entries) entries[i]++;
+        }
+    }
+    for (int i = 0; i < server_list->count && entries; i++) {
+        entries[i] += server_list->servers[i].connected;
+    }
+    return mask;
+}
+
+// 1 if a file can go up in a batch: a small, plain replicated put
+int batchable(FileQueue *queue, int file) {
+    return queue->put && ec_data == 0 && dedup_avg == 0 && compress_codec == CODEC_NONE &&
+           queue->sizes[file] >= 0 && queue->sizes[file] <= SMALL_FILE;
+}
+
+// next file (or batch of small ones) for a worker, into picked; how many, 0 once the queue is empty
+//busy gets the servers it was counted against, to hand back to queue_done
+int queue_take(FileQueue *queue, int *picked, unsigned *busy) {
+    pthread_mutex_lock(&queue->lock);
+    int oldest = -1, pick = -1;
+    for (int f = queue->head; f < queue->count && f < queue->head + SCHEDULE_LOOKAHEAD && pick < 0; f++) {
+        if (queue->taken[f]) continue;
+        if (oldest < 0) oldest = f;
+        int idle = 1;
+        for (int i = 0; i < queue->config->count; i++) {
+            if ((queue->servers[f] >> i & 1) && queue->busy[i] >= queue->per_server) idle = 0;
+        }
+        if (idle) pick = f;
+    }
+    if (pick < 0) pick = oldest;
+    if (pick < 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+    
+    // small files after it join the batch for as long as each server's share fits in one job
+    int count = 0;
+    int entries[MAX_SERVERS] = {0};
+    *busy = 0;
+    for (int f = pick; f < queue->count && count < queue->batch_max; f++) {
+        if (queue->taken[f]) continue;
+        if (f != pick && !(batchable(queue, pick) && batchable(queue, f))) break;
+        
+        int more[MAX_SERVERS];
+        memcpy(more, entries, sizeof(more));
+        file_servers(queue, f, more);
+        int fits = 1;
+        for (int i = 0; i < queue->config->count; i++) {
+            if (more[i] > MAX_CHUNKS) fits = 0;
+        }
+        if (f != pick && !fits) break;
+        
+        memcpy(entries, more, sizeof(entries));
+        queue->taken[f] = 1;
+        *busy |= queue->servers[f];
+        picked[count++] = f;
+    }
+    for (int i = 0; i < queue->config->count; i++) {
+        queue->busy[i] += *busy >> i & 1;
+    }
+    while (queue->head < queue->count && queue->taken[queue->head]) {
+        queue->head++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+// a file or batch from queue_take is done with the servers in busy
+void queue_done(FileQueue *queue, unsigned busy) {
+    pthread_mutex_lock(&queue->lock);
+    for (int i = 0; i < queue->config->count; i++) {
+        queue->busy[i] -= busy >> i & 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// take files off the queue until it is empty
+void *file_worker(void *arg) {
+    FileWorker *worker = (FileWorker *)arg;
+    FileQueue *queue = worker->queue;
+    int *picked = malloc(queue->batch_max * sizeof(int));
+    if (!picked) {
+        return NULL;
+    }
+    
+    int count;
+    unsigned busy;
+    while ((count = queue_take(queue, picked, &busy)) > 0) {
+        if (count > 1) {
+            put_batch(worker->servers, queue->files, queue->sizes, picked, count);
+        } else if (queue->put) {
+            put_file(worker->servers, queue->files[picked[0]]);
+        } else {
+            get_file(worker->servers, queue->files[picked[0]]);
+        }
+        queue_done(queue, busy);
+    }
+    free(picked);
+    return NULL;
+}
+
+// read a small chunk (at most max bytes) into buf; its length, or -1 if missing or too big
+long fetch_small(Server *server, const char *filename, int chunk, char *buf, long max) {
+    long len = -1;
+    if (server->binary) {
+        dfs_frame response;
+        if (send_request(server, OP_GET, filename, chunk, 0, NULL) < 0 || recv_response(server, &response) < 0 ||
+            response.status != ST_OK) {
+            return -1;
+        }
+        len = response.length;
+    } else {
+        char command[BUFFER_SIZE];
+        char reply[64];
+        snprintf(command, sizeof(command), "GET %s %d\n", filename, chunk);
+        if (send_all(server->socket, command, strlen(command), NULL) < 0 || recv_line(server->socket, reply, sizeof(reply)) < 0 ||
+            sscanf(reply, "DATA %ld", &len) != 1) {
+            return -1;
+        }
+    }
+    
+    // the reply has to come off the wire even if it is too big to keep
+    long got = 0;
+    while (got < len) {
+        char scratch[BUFFER_SIZE];
+        long take = len - got < BUFFER_SIZE ? len - got : BUFFER_SIZE;
+        if (recv_all(server->socket, scratch, take, NULL) < 0) {
+            return -1;
+        }
+        if (got + take <= max) {
+            memcpy(buf + got, scratch, take);
+        }
+        got += take;
+    }
+    return len <= max ? len : -1;
+}
+
+// the file's layout record (chunk 0), the newest any server has (a server that was down through
+//a later put still holds the old one); -1 if none does
+int fetch_layout(ServerList *server_list, const char *filename, dfs_layout *layout) {
+    int found = 0;
+    for (int i = 0; i < server_list->count; i++) {
+        char record[DFS_LAYOUT_SIZE];
+        dfs_layout candidate;
+        if (server_list->servers[i].connected) {
+            long len = fetch_small(&server_list->servers[i], filename, DFS_LAYOUT_CHUNK, record, sizeof(record));
+            if (len > 0 && dfs_decode_layout((unsigned char *)record, len, &candidate) == 0 &&
+                (!found || candidate.stamp > layout->stamp)) {
+                *layout = candidate;
+                found = 1;
+            }
+        }
+    }
+    return found ? 0 : -1;
+}
+
+// store the layout record as chunk 0 on server; 0 ok, -1 on error
+int put_layout(Server *server, const char *filename, const dfs_layout *layout) {
+    unsigned char record[DFS_LAYOUT_SIZE];
+    dfs_encode_layout(layout, record);
+    return put_small(server, filename, DFS_LAYOUT_CHUNK, (char *)record, DFS_LAYOUT_SIZE);
+}
+
+// store a chunk held in memory (a layout record, a recipe) on server; 0 ok, -1 on error
+int put_small(Server *server, const char *filename, int chunk, const char *data, long len) {
+    if (server->binary) {
+        dfs_frame response;
+        return send_request(server, OP_PUT, filename, chunk, len, NULL) == 0 &&
+               send_all(server->socket, data, len, NULL) == 0 &&
+               recv_response(server, &response) == 0 && response.status == ST_OK &&
+               (!(response.flags & DFS_FLAG_CHECKSUM) || response.checksum == crc32c(0, data, len)) ? 0 : -1;
+    }
+    
+    char command[BUFFER_SIZE];
+    char reply[16];
+    snprintf(command, sizeof(command), "PUT %s %ld 1\nCHUNK %d %ld\n", filename, len, chunk, len);
+    if (send_all(server->socket, command, strlen(command), NULL) < 0 ||
+        send_all(server->socket, data, len, NULL) < 0) {
+        return -1;
+    }
+    int received = recv(server->socket, reply, sizeof(reply) - 1, 0);
+    return received >= 2 && strncasecmp(reply, "OK", 2) == 0 ? 0 : -1;
+}
+
+// layout for a new replicated file from the stripe settings
+//chunk_size set: as many chunks as that takes (at most MAX_CHUNKS, beyond which chunks grow),
+//otherwise one chunk per server of the stripe
+void plan_layout(long file_size, int server_count, dfs_layout *layout) {
+    int width = stripe_width > 0 && stripe_width < server_count ? stripe_width : server_count;
+    long chunks = width;
+    if (stripe_chunk > 0) {
+        chunks = (file_size + stripe_chunk - 1) / stripe_chunk;
+        if (chunks > MAX_CHUNKS) chunks = MAX_CHUNKS;
+        if (chunks < 1) chunks = 1;
+    }
+    
+    memset(layout, 0, sizeof(*layout));
+    layout->scheme = LAYOUT_REPLICATED;
+    layout->data_chunks = chunks;
+    layout->replicas = replica_count < width ? replica_count : width;
+    layout->width = width < server_count ? width : 0;  // 0 = all, including servers added later
+    layout->placement = PLACE_RENDEZVOUS;
+    layout->stamp = time(NULL);
+    layout->file_size = file_size;
+    layout->chunk_size = (file_size + chunks - 1) / chunks;
+}
+
+// server holding replica r of chunk c (or erasure shard c)
+//ring layouts use consecutive servers of the stripe, starting at hash % count
+int layout_server(const dfs_layout *layout, ServerList *server_list, char *filename, int chunk, int replica) {
+    if (layout->placement == PLACE_RENDEZVOUS) {
+        return rendezvous_server(layout, server_list, filename, chunk, replica);
+    }
+    int width = layout->width > 0 && layout->width <= server_list->count ? layout->width : server_list->count;
+    int x = get_file_hash(filename) % server_list->count;
+    return (x + (chunk + replica) % width) % server_list->count;
+}
+
+// rendezvous score of a server (by its dfc.conf name) for chunk of filename: 64 bit FNV-1a of
+//all three, finished with a murmur mix so neighbouring chunk numbers give unrelated scores
+uint64_t hrw_score(const char *server, const char *filename, int chunk) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = server; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h = (h ^ 0xff) * 1099511628211ULL;
+    for (const char *p = filename; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h = (h ^ (uint32_t)chunk) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// rendezvous (highest random weight) placement
+//the file's stripe is its `width` best servers by score(server, file, -1), and replica r of a
+//chunk is the r-th best stripe server by score(server, file, chunk). a server joining or leaving
+//only moves what it wins or held; everything else stays put
+//erasure shards also need spreading out, so every (shard, server) pair is taken best score first
+//and each shard goes to the first server it meets that still has room for an even share
+int rendezvous_server(const dfs_layout *layout, ServerList *server_list, char *filename, int chunk, int replica) {
+    int n = server_list->count;
+    int width = layout->width > 0 && layout->width < n ? layout->width : n;
+    int in_stripe[MAX_SERVERS] = {0};
+    uint64_t score[MAX_SERVERS];
+    
+    for (int i = 0; i < n; i++) {
+        score[i] = hrw_score(server_list->servers[i].hostname, filename, -1);
+    }
+    for (int w = 0; w < width; w++) {
+        int best = -1;
+        for (int i = 0; i < n; i++) {
+            if (!in_stripe[i] && (best < 0 || score[i] > score[best])) best = i;
+        }
+        in_stripe[best] = 1;
+    }
+    
+    if (layout->scheme != LAYOUT_ERASURE) {
+        int taken[MAX_SERVERS] = {0};
+        int pick = -1;
+        for (int i = 0; i < n; i++) {
+            score[i] = hrw_score(server_list->servers[i].hostname, filename, chunk);
+        }
+        for (int r = 0; r <= replica % width; r++) {
+            pick = -1;
+            for (int i = 0; i < n; i++) {
+                if (in_stripe[i] && !taken[i] && (pick < 0 || score[i] > score[pick])) pick = i;
+            }
+            taken[pick] = 1;
+        }
+        return pick;
+    }
+    
+    int shards = layout->data_chunks + layout->parity_chunks;
+    int room = (shards + width - 1) / width;
+    int load[MAX_SERVERS] = {0};
+    int placed[MAX_CHUNKS];
+    uint64_t pair[MAX_CHUNKS][MAX_SERVERS];
+    for (int s = 0; s < shards; s++) {
+        placed[s] = -1;
+        for (int i = 0; i < n; i++) {
+            pair[s][i] = in_stripe[i] ? hrw_score(server_list->servers[i].hostname, filename, s) : 0;
+        }
+    }
+    for (int round = 0; round < shards; round++) {
+        int best_shard = -1, best_server = -1;
+        for (int s = 0; s < shards; s++) {
+            for (int i = 0; i < n && placed[s] < 0; i++) {
+                if (in_stripe[i] && load[i] < room &&
+                    (best_shard < 0 || pair[s][i] > pair[best_shard][best_server])) {
+                    best_shard = s;
+                    best_server = i;
+                }
+            }
+        }
+        placed[best_shard] = best_server;
+        load[best_server]++;
+        if (best_shard == chunk) break;
+    }
+    return placed[chunk];
+}
+
+// actual length of each chunk of a layout, the last ones may be short or empty
+void layout_chunk_len(const dfs_layout *layout, long *chunk_len) {
+    for (int c = 0; c < layout->data_chunks; c++) {
+        long left = (long)layout->file_size - c * (long)layout->chunk_size;
+        chunk_len[c] = left < 0 ? 0 : (left < (long)layout->chunk_size ? left : (long)layout->chunk_size);
+    }
+}
+
+// start an empty plan; every job it makes starts as a copy of base
+void plan_init(TransferPlan *plan, char *filename, long *chunk_len, long chunk_size, int fd) {
+    memset(plan, 0, sizeof(*plan));
+    plan->base.filename = filename;
+    plan->base.chunk_len = chunk_len;
+    plan->base.chunk_size = chunk_size;
+    plan->base.file_fd = fd;
+}
+
+// the job for server `index`, made on first use
+TransferJob *plan_job(TransferPlan *plan, ServerList *server_list, int index) {
+    if (plan->slot[index] == 0) {
+        TransferJob *job = &plan->jobs[plan->job_count];
+        memcpy(job, &plan->base, sizeof(*job));
+        job->server = &server_list->servers[index];
+        job->server_index = index;
+        plan->slot[index] = ++plan->job_count;
+    }
+    return &plan->jobs[plan->slot[index] - 1];
+}
+
+// queue chunk (at offset in the local file) on the job for server `index`
+void plan_add(TransferPlan *plan, ServerList *server_list, int index, int chunk, off_t offset, long bytes) {
+    TransferJob *job = plan_job(plan, server_list, index);
+    job->offsets[job->chunk_count] = offset;
+    job->chunks[job->chunk_count++] = chunk;
+    job->bytes_total += bytes;
+}
+
+// streamed plans (run with stream_worker): queue chunk on the queue of server `index`'s job, as many
+//as it takes; piece is its piece for a get, -1 for a put. 0 ok, -1 if out of memory
+int plan_queue(TransferPlan *plan, ServerList *server_list, int index, int chunk, off_t offset, long bytes, int piece) {
+    TransferJob *job = plan_job(plan, server_list, index);
+    ChunkQueue *queue = &plan->queues[plan->slot[index] - 1];
+    job->queue = queue;
+    queue->batch = plan->batch;
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : MAX_CHUNKS;
+        int *chunks = realloc(queue->chunks, capacity * sizeof(int));
+        if (chunks) queue->chunks = chunks;
+        off_t *offsets = chunks ? realloc(queue->offsets, capacity * sizeof(off_t)) : NULL;
+        if (offsets) queue->offsets = offsets;
+        int *pieces = offsets ? realloc(queue->piece, capacity * sizeof(int)) : NULL;
+        if (pieces) queue->piece = pieces;
+        char *bad = pieces ? realloc(queue->bad, capacity) : NULL;
+        if (!bad) {
+            return -1;
+        }
+        queue->bad = bad;
+        queue->capacity = capacity;
+    }
+    queue->chunks[queue->count] = chunk;
+    queue->offsets[queue->count] = offset;
+    queue->piece[queue->count] = piece;
+    queue->bad[queue->count++] = 0;
+    job->bytes_total += bytes;
+    return 0;
+}
+
+// free a streamed plan's queues
+void plan_free(TransferPlan *plan) {
+    for (int j = 0; j < plan->job_count; j++) {
+        free(plan->queues[j].chunks);
+        free(plan->queues[j].offsets);
+        free(plan->queues[j].piece);
+        free(plan->queues[j].bad);
+    }
+}
+
+// split the buffer budget between the jobs, in whole pages (put maps its windows)
+void plan_windows(TransferPlan *plan) {
+    long page = sysconf(_SC_PAGESIZE);
+    long window = plan->job_count ? buffer_budget / plan->job_count : buffer_budget;
+    window -= window % page;
+    if (window < page) {
+        window = page;
+    }
+    for (int j = 0; j < plan->job_count; j++) {
+        plan->jobs[j].window = window;
+    }
+}
+
+// after a put: note which servers took their chunks, and store the layout on every server that is
+//up, so one left holding an older version of the file can't pass off its record as current
+void plan_commit(TransferPlan *plan, ServerList *server_list, char *filename, const dfs_layout *layout, int *stored) {
+    int layout_ok[MAX_SERVERS] = {0};
+    for (int i = 0; i < server_list->count; i++) {
+        if (server_list->servers[i].connected) {
+            layout_ok[i] = put_layout(&server_list->servers[i], filename, layout) == 0;
+        }
+    }
+    
+    memset(stored, 0, MAX_SERVERS * sizeof(int));
+    for (int j = 0; j < plan->job_count; j++) {
+        int i = plan->jobs[j].server - server_list->servers;
+        stored[i] = !plan->jobs[j].failed && layout_ok[i];
+    }
+}
+
+// download every piece into fd, all servers at once; each piece goes to whichever of its untried,
+//connected sources should finish it soonest, going by that server's read rate, round trip and what
+//is queued on it already. servers done with their own share hedge for stragglers (get_worker).
+//each server's share streams through its connection a batch at a time (stream_worker), however many
+//pieces there are. a piece that didn't arrive intact (missing, broken transfer, failed checksum) is
+//fetched again from another source; 0 once everything is in, -1 if a piece runs out of sources (it
+//stays !done) or there is no memory to queue them
+//with a codec the pieces arrive compressed: chunk_size is then the most a chunk can take on the wire
+//(packed_bound) and chunk_len gets the decoded lengths
+int fetch_pieces(ServerList *server_list, char *filename, int fd, long *chunk_len, long chunk_size,
+                 GetPiece *pieces, int count, char (*names)[DEDUP_NAME], int codec) {
+    off_t spare = 0;
+    for (int p = 0; p < count; p++) {
+        if (pieces[p].offset + chunk_size > spare) spare = pieces[p].offset + chunk_size;
+    }
+    
+    while (1) {
+        TransferPlan plan;
+        plan_init(&plan, filename, chunk_len, chunk_size, fd);
+        plan.base.pieces = pieces;
+        plan.base.piece_count = count;
+        plan.base.spare = spare;
+        plan.base.names = names;
+        plan.base.codec = codec;
+        plan.batch = get_worker;
+        int queued_ok = 1;
+        for (int p = 0; p < count && queued_ok; p++) {
+            GetPiece *piece = &pieces[p];
+            piece->server = -1;
+            if (piece->done) continue;
+            
+            int best = -1;
+            double best_cost = 0;
+            for (int s = 0; s < piece->source_count; s++) {
+                int i = piece->sources[s];
+                if ((piece->tried >> i & 1) || !server_list->servers[i].connected) continue;
+                long queued = plan.slot[i] ? plan.jobs[plan.slot[i] - 1].bytes_total : 0;
+                double cost = (queued + piece->bytes) / read_rate(server_list, i) + server_list->servers[i].rtt_us / 1e6;
+                if (best < 0 || cost < best_cost) {
+                    best = i;
+                    best_cost = cost;
+                }
+            }
+            if (best < 0) {
+                plan_free(&plan);
+                return -1;
+            }
+            if (piece->tried) {
+                printf("chunk %d: trying %s\n", piece->chunk + 1, server_list->servers[best].hostname);
+            }
+            queued_ok = plan_queue(&plan, server_list, best, piece->chunk, piece->offset, piece->bytes, p) == 0;
+            piece->server = queued_ok ? best : -1;
+        }
+        if (!queued_ok) {
+            perror("memory allocation failed");
+            plan_free(&plan);
+            return -1;
+        }
+        if (plan.job_count == 0) {
+            return 0;
+        }
+        
+        for (int p = 0; p < count; p++) {
+            GetPiece *piece = &pieces[p];
+            if (piece->server < 0) continue;
+            piece->owner = &plan.jobs[plan.slot[piece->server] - 1];
+            piece->owner_sock = server_list->servers[piece->server].socket;
+            pthread_mutex_init(&piece->lock, NULL);
+            atomic_init(&piece->active, 1);
+            atomic_init(&piece->started_us, 0);
+            atomic_init(&piece->hedged, 0);
+            piece->hedge_sock = -1;
+            piece->won = 0;
+        }
+        
+        plan_windows(&plan);
+        run_transfers(plan.jobs, plan.job_count, stream_worker, "download");
+        
+        // a connection that broke (or lost to a hedge) was only shut down, so nothing reused its fd mid round
+        //one that lost to a hedge is fine otherwise, so it is dialed again for the rounds after
+        for (int j = 0; j < plan.job_count; j++) {
+            if (!plan.jobs[j].server->connected && plan.jobs[j].server->socket >= 0) {
+                close(plan.jobs[j].server->socket);
+                plan.jobs[j].server->socket = -1;
+            }
+            if (plan.jobs[j].cut_off) {
+                connect_server(plan.jobs[j].server);
+            }
+        }
+        
+        // what arrived intact from either copy is in; the rest move on to another source (but a piece
+        //left waiting behind one a hedge won can try the same server again)
+        for (int p = 0; p < count; p++) {
+            GetPiece *piece = &pieces[p];
+            if (piece->server < 0) continue;
+            pthread_mutex_destroy(&piece->lock);
+            if (atomic_load(&piece->hedged)) {
+                printf("chunk %d: hedged to %s after %ld ms, %s copy kept\n", piece->chunk + 1,
+                       server_list->servers[piece->hedge_server].hostname, piece->hedge_after_us / 1000,
+                       piece->won == 2 ? "its" : (piece->won == 1 ? "original" : "no"));
+            }
+            piece->done = piece->won != 0;
+            if (!piece->done && !piece->owner->cut_off) {
+                piece->tried |= 1u << piece->server;
+            }
+        }
+        plan_free(&plan);
+    }
+}
+
+// trim a finished download to size and move it into place; -1 (part file removed) on error
+int finish_part(int fd, const char *part_path, const char *filename, off_t size) {
+    if (ftruncate(fd, size) < 0 || close(fd) < 0 || rename(part_path, filename) < 0) {
+        perror("error writing output file");
+        unlink(part_path);
+        return -1;
+    }
+    return 0;
+}
+
+// most a chunk of chunk_size raw bytes can take compressed: every block stored as is, plus its header
+long packed_bound(long chunk_size) {
+    return chunk_size + (chunk_size + DFS_BLOCK_SIZE - 1) / DFS_BLOCK_SIZE * DFS_BLOCK_HEADER;
+}
+
+// one block of at most DFS_BLOCK_SIZE raw bytes as header + data into out (room for
+//DFS_BLOCK_HEADER + len); compressed if that saves anything, else stored as is. bytes used
+long pack_block(const uint8_t *raw, long len, uint8_t *out) {
+    int stored = lz_compress(raw, len, out + DFS_BLOCK_HEADER, len - 1);
+    dfs_put32(out, len);
+    if (stored > 0) {
+        dfs_put32(out + 4, stored);
+    } else {
+        stored = len;
+        dfs_put32(out + 4, stored | DFS_BLOCK_RAW);
+        memcpy(out + DFS_BLOCK_HEADER, raw, len);
+    }
+    return DFS_BLOCK_HEADER + stored;
+}
+
+// compress a few blocks spread over the file; 1 if they shrink by an eighth or more
+//(already compressed data, media and the like comes back as is, so it is sent raw without the cost)
+int worth_compressing(int fd, long file_size) {
+    uint8_t *raw = malloc(DFS_BLOCK_SIZE);
+    uint8_t *out = malloc(DFS_BLOCK_HEADER + DFS_BLOCK_SIZE);
+    long blocks = (file_size + DFS_BLOCK_SIZE - 1) / DFS_BLOCK_SIZE;
+    long samples = blocks < COMPRESS_SAMPLES ? blocks : COMPRESS_SAMPLES;
+    long in_bytes = 0, out_bytes = 0;
+    for (long i = 0; raw && out && i < samples; i++) {
+        off_t at = (off_t)(i * blocks / samples) * DFS_BLOCK_SIZE;
+        ssize_t got = pread(fd, raw, DFS_BLOCK_SIZE, at);
+        if (got <= 0) {
+            break;
+        }
+        in_bytes += got;
+        out_bytes += pack_block(raw, got, out);
+    }
+    free(raw);
+    free(out);
+    return in_bytes > 0 && out_bytes * 8 <= in_bytes * 7;
+}
+
+// thread: pack chunks in file order into free slots of the ring until none are left, skipping any
+//whose servers have all given up on it
+void *pack_worker(void *arg) {
+    PackJob *pack = (PackJob *)arg;
+    uint8_t *raw = malloc(DFS_BLOCK_SIZE);
+    uint8_t *out = malloc(DFS_BLOCK_HEADER + DFS_BLOCK_SIZE);
+    
+    pthread_mutex_lock(&pack->lock);
+    if (!raw || !out) {
+        pack->failed = 1;
+        pthread_cond_broadcast(&pack->changed);
+    }
+    while (1) {
+        while (pack->next < pack->chunks && pack->refs[pack->next] == 0) {
+            pack->next++;
+        }
+        if (pack->failed || pack->next >= pack->chunks) {
+            break;
+        }
+        if (__builtin_popcountll(pack->busy) == pack->slots) {
+            pthread_cond_wait(&pack->changed, &pack->lock);
+            continue;
+        }
+        int c = pack->next++;
+        int s = __builtin_ctzll(~pack->busy);
+        pack->busy |= 1ULL << s;
+        pack->slot_of[c] = s;
+        pthread_mutex_unlock(&pack->lock);
+        
+        off_t from = (off_t)c * pack->chunk_size;
+        off_t to = (off_t)s * pack->slot;
+        long packed = 0;
+        int failed = 0;
+        for (long pos = 0; pos < pack->chunk_len[c] && !failed; pos += DFS_BLOCK_SIZE) {
+            long len = pack->chunk_len[c] - pos < DFS_BLOCK_SIZE ? pack->chunk_len[c] - pos : DFS_BLOCK_SIZE;
+            long used = pread(pack->src_fd, raw, len, from + pos) == len ? pack_block(raw, len, out) : -1;
+            failed = used < 0 || pwrite(pack->dst_fd, out, used, to + packed) != used;
+            packed += used;
+        }
+        
+        pthread_mutex_lock(&pack->lock);
+        pack->packed_len[c] = packed;
+        pack->ready[c] = !failed;
+        pack->failed |= failed;
+        if (pack->refs[c] == 0) {
+            pack->busy &= ~(1ULL << s);
+        }
+        pthread_cond_broadcast(&pack->changed);
+    }
+    pthread_mutex_unlock(&pack->lock);
+    free(raw);
+    free(out);
+    return NULL;
+}
+
+// start packing a replicated file's chunks for the plan's jobs (each set up with pack), a thread per
+//core, as many slots as buffer_budget holds (two at least, so packing runs ahead of sending); 0 if
+//under way (pack_finish it), -1 if it couldn't be
+int pack_start(PackJob *pack, int fd, const dfs_layout *layout, const long *chunk_len, long *packed_len,
+               const TransferPlan *plan) {
+    memset(pack, 0, sizeof(*pack));
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    pack->dst_fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+    if (pack->dst_fd < 0) {
+        perror("error creating scratch file");
+        return -1;
+    }
+    pack->src_fd = fd;
+    pack->chunk_len = chunk_len;
+    pack->packed_len = packed_len;
+    pack->chunk_size = layout->chunk_size;
+    pack->slot = packed_bound(layout->chunk_size);
+    pack->chunks = layout->data_chunks;
+    long slots = buffer_budget / pack->slot;
+    slots = slots < 2 ? 2 : slots;
+    pack->slots = slots < pack->chunks ? slots : pack->chunks;
+    for (int j = 0; j < plan->job_count; j++) {
+        for (int k = 0; k < plan->jobs[j].chunk_count; k++) {
+            pack->refs[plan->jobs[j].chunks[k]]++;
+        }
+    }
+    pthread_mutex_init(&pack->lock, NULL);
+    pthread_cond_init(&pack->changed, NULL);
+    
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cores < 1 ? 1 : (cores < pack->slots ? cores : pack->slots);
+    for (; pack->thread_count < thread_count; pack->thread_count++) {
+        if (pthread_create(&pack->threads[pack->thread_count], NULL, pack_worker, pack) != 0) {
+            break;
+        }
+    }
+    if (pack->thread_count == 0) {
+        pthread_mutex_destroy(&pack->lock);
+        pthread_cond_destroy(&pack->changed);
+        close(pack->dst_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// wait for chunk to be packed: where it is in the scratch file and how long; -1 if packing failed
+int pack_wait(PackJob *pack, int chunk, off_t *offset, long *len) {
+    pthread_mutex_lock(&pack->lock);
+    while (!pack->ready[chunk] && !pack->failed) {
+        pthread_cond_wait(&pack->changed, &pack->lock);
+    }
+    int ready = pack->ready[chunk];
+    *offset = (off_t)pack->slot_of[chunk] * pack->slot;
+    *len = pack->packed_len[chunk];
+    pthread_mutex_unlock(&pack->lock);
+    return ready ? 0 : -1;
+}
+
+// server is done with chunk (sent, or given up on); its slot frees once every server is
+void pack_release(PackJob *pack, int server, int chunk) {
+    pthread_mutex_lock(&pack->lock);
+    if (!(pack->released[server] >> chunk & 1)) {
+        pack->released[server] |= 1ULL << chunk;
+        if (--pack->refs[chunk] == 0 && pack->ready[chunk]) {
+            pack->busy &= ~(1ULL << pack->slot_of[chunk]);
+            pthread_cond_broadcast(&pack->changed);
+        }
+    }
+    pthread_mutex_unlock(&pack->lock);
+}
+
+// after the transfers: wait for the packing threads and drop the scratch file
+void pack_finish(PackJob *pack) {
+    for (int t = 0; t < pack->thread_count; t++) {
+        pthread_join(pack->threads[t], NULL);
+    }
+    pthread_mutex_destroy(&pack->lock);
+    pthread_cond_destroy(&pack->changed);
+    close(pack->dst_fd);
+}
+
+// put_worker for a compressed put: whatever chunks it didn't get to (it failed) are let go of too,
+//so the ring doesn't wait on them
+void *pack_put_worker(void *arg) {
+    TransferJob *job = (TransferJob *)arg;
+    put_worker(job);
+    for (int c = 0; c < job->chunk_count; c++) {
+        pack_release(job->pack, job->server_index, job->chunks[c]);
+    }
+    return NULL;
+}
+
+// replicated put: each chunk to `replicas` consecutive servers of the stripe, all servers at once,
+//then the layout record to every server that took its chunks
+//with compression on and a file that samples well, chunks go up as LZ4 blocks packed just ahead of them
+void put_striped(ServerList *server_list, char *filename, int file_fd, long file_size) {
+    dfs_layout layout;
+    plan_layout(file_size, server_list->count, &layout);
+    long chunk_len[MAX_CHUNKS];
+    layout_chunk_len(&layout, chunk_len);
+    
+    printf("file %s maps to %d (%d chunks over %d servers, %d replicas)\n", filename,
+           layout_server(&layout, server_list, filename, 0, 0), layout.data_chunks,
+           layout.width ? layout.width : server_list->count, layout.replicas);
+    
+    // chunks go up as they are, or packed (pack_put_worker) if the file compresses
+    int compress = compress_codec == CODEC_LZ4 && file_size > 0;
+    if (compress && !worth_compressing(file_fd, file_size)) {
+        printf("%s doesn't compress, sending it as is\n", filename);
+        compress = 0;
+    }
+    
+    TransferPlan plan;
+    plan_init(&plan, filename, chunk_len, compress ? packed_bound(layout.chunk_size) : (long)layout.chunk_size, file_fd);
+    for (int c = 0; c < layout.data_chunks; c++) {
+        int placed = 0;
+        for (int r = 0; r < layout.replicas; r++) {
+            int i = layout_server(&layout, server_list, filename, c, r);
+            if (server_list->servers[i].connected) {
+                plan_add(&plan, server_list, i, c, (off_t)c * layout.chunk_size, chunk_len[c]);
+                placed++;
+            }
+        }
+        if (placed == 0) {
+            printf("%s put failed: no server for chunk %d\n", filename, c + 1);
+            return;
+        }
+    }
+    
+    PackJob pack;
+    long packed_len[MAX_CHUNKS];
+    if (compress && pack_start(&pack, file_fd, &layout, chunk_len, packed_len, &plan) < 0) {
+        printf("%s: compression failed, sending it as is\n", filename);
+        compress = 0;
+        for (int j = 0; j < plan.job_count; j++) {
+            plan.jobs[j].chunk_size = layout.chunk_size;
+        }
+    }
+    for (int j = 0; j < plan.job_count && compress; j++) {
+        plan.jobs[j].pack = &pack;
+        plan.jobs[j].file_fd = pack.dst_fd;
+    }
+    if (compress) {
+        layout.codec = CODEC_LZ4;
+    }
+    
+    plan_windows(&plan);
+    run_transfers(plan.jobs, plan.job_count, compress ? pack_put_worker : put_worker, "upload");
+    if (compress) {
+        pack_finish(&pack);
+        long packed = 0;
+        for (int c = 0; c < layout.data_chunks; c++) {
+            packed += pack.ready[c] ? packed_len[c] : chunk_len[c];
+        }
+        printf("%s compressed to %ld of %ld bytes (%.0f%%)\n", filename, packed, file_size,
+               100.0 * packed / file_size);
+    }
+    
+    // a chunk is stored if any of its replicas is
+    int stored[MAX_SERVERS];
+    plan_commit(&plan, server_list, filename, &layout, stored);
+    int lost = 0, degraded = 0;
+    for (int c = 0; c < layout.data_chunks; c++) {
+        int copies = 0;
+        for (int r = 0; r < layout.replicas; r++) {
+            copies += stored[layout_server(&layout, server_list, filename, c, r)];
+        }
+        lost += copies == 0;
+        degraded += copies > 0 && copies < layout.replicas;
+    }
+    
+    if (lost > 0) {
+        printf("%s put failed: %d of %d chunks not stored\n", filename, lost, layout.data_chunks);
+    } else if (degraded > 0) {
+        printf("file %s uploaded with %d chunk(s) short of %d replicas\n", filename, degraded, layout.replicas);
+    } else {
+        printf("file %s uploaded successfully\n", filename);
+    }
+}
+
+// replicated put of several small files as one transfer: their data and layout records are copied into
+//a scratch file and each server gets a PUT per chunk (and record) of every file, back to back on its
+//connection, instead of a round of transfers and record puts per file
+void put_batch(ServerList *server_list, char **files, const long *sizes, const int *picked, int count) {
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    int scratch = open(dir, O_TMPFILE | O_RDWR, 0600);
+    dfs_layout *layouts = malloc(count * sizeof(dfs_layout));
+    int capacity = count * (MAX_CHUNKS + 1);
+    WireChunk *wire = malloc(capacity * sizeof(WireChunk));
+    long *chunk_len = malloc(capacity * sizeof(long));
+    char *buf = malloc(SMALL_FILE);
+    if (scratch < 0 || !layouts || !wire || !chunk_len || !buf) {
+        perror("error preparing batch");
+        if (scratch >= 0) close(scratch);
+        free(layouts);
+        free(wire);
+        free(chunk_len);
+        free(buf);
+        return;
+    }
+    
+    // scratch: each file's bytes then its layout record; entry e is wire[e] at that place in it
+    TransferPlan plan;
+    plan_init(&plan, files[picked[0]], chunk_len, SMALL_FILE, scratch);
+    plan.base.wire = wire;
+    off_t end = 0;
+    long total = 0;
+    int entries = 0;
+    int ok = 1;
+    for (int f = 0; f < count && ok; f++) {
+        char *filename = files[picked[f]];
+        dfs_layout *layout = &layouts[f];
+        plan_layout(sizes[picked[f]], server_list->count, layout);
+        int fd = open(filename, O_RDONLY);
+        long len = fd < 0 ? -1 : pread(fd, buf, sizes[picked[f]], 0);
+        if (fd >= 0) close(fd);
+        unsigned char record[DFS_LAYOUT_SIZE];
+        dfs_encode_layout(layout, record);
+        if (len != sizes[picked[f]] || pwrite(scratch, buf, len, end) != len ||
+            pwrite(scratch, record, DFS_LAYOUT_SIZE, end + len) != DFS_LAYOUT_SIZE) {
+            printf("error reading %s for the batch, putting the files one at a time\n", filename);
+            ok = 0;
+            break;
+        }
+        
+        long lengths[MAX_CHUNKS];
+        layout_chunk_len(layout, lengths);
+        for (int c = 0; c < layout->data_chunks; c++) {
+            wire[entries].name = filename;
+            wire[entries].chunk = c + 1;
+            chunk_len[entries] = lengths[c];
+            for (int r = 0; r < layout->replicas; r++) {
+                int i = layout_server(layout, server_list, filename, c, r);
+                if (server_list->servers[i].connected) {
+                    plan_add(&plan, server_list, i, entries, end + (off_t)c * layout->chunk_size, lengths[c]);
+                }
+            }
+            entries++;
+        }
+        wire[entries].name = filename;
+        wire[entries].chunk = DFS_LAYOUT_CHUNK;
+        chunk_len[entries] = DFS_LAYOUT_SIZE;
+        for (int i = 0; i < server_list->count; i++) {
+            if (server_list->servers[i].connected) {
+                plan_add(&plan, server_list, i, entries, end + len, DFS_LAYOUT_SIZE);
+            }
+        }
+        entries++;
+        end += len + DFS_LAYOUT_SIZE;
+        total += len;
+    }
+    
+    if (!ok) {
+        close(scratch);
+        free(layouts);
+        free(wire);
+        free(chunk_len);
+        free(buf);
+        for (int f = 0; f < count; f++) {
+            put_file(server_list, files[picked[f]]);
+        }
+        return;
+    }
+    
+    printf("putting %d small files as a batch (%ld bytes)\n", count, total);
+    plan_windows(&plan);
+    run_transfers(plan.jobs, plan.job_count, put_worker, "upload");
+    close(scratch);
+    
+    // a server's share went up in full (every one of its jobs) or not at all; a chunk is stored if
+    //any of its replicas is
+    int stored[MAX_SERVERS] = {0};
+    for (int j = 0; j < plan.job_count; j++) {
+        stored[plan.jobs[j].server_index] = 1;
+    }
+    for (int j = 0; j < plan.job_count; j++) {
+        stored[plan.jobs[j].server_index] &= !plan.jobs[j].failed;
+    }
+    for (int f = 0; f < count; f++) {
+        char *filename = files[picked[f]];
+        dfs_layout *layout = &layouts[f];
+        int lost = 0, degraded = 0;
+        for (int c = 0; c < layout->data_chunks; c++) {
+            int copies = 0;
+            for (int r = 0; r < layout->replicas; r++) {
+                copies += stored[layout_server(layout, server_list, filename, c, r)];
+            }
+            lost += copies == 0;
+            degraded += copies > 0 && copies < layout->replicas;
+        }
+        
+        if (lost > 0) {
+            printf("%s put failed: %d of %d chunks not stored\n", filename, lost, layout->data_chunks);
+        } else if (degraded > 0) {
+            printf("file %s uploaded with %d chunk(s) short of %d replicas\n", filename, degraded, layout->replicas);
+        } else {
+            printf("file %s uploaded successfully\n", filename);
+        }
+    }
+    
+    free(layouts);
+    free(wire);
+    free(chunk_len);
+    free(buf);
+}
+
+// replicated get: every chunk from its first reachable replica, which spreads the chunks over the
+//whole stripe when all servers are up; a chunk that fails comes from its next replica
+void get_striped(ServerList *server_list, char *filename, const dfs_layout *layout) {
+    if (layout->data_chunks < 1 || layout->data_chunks > MAX_CHUNKS) {
+        printf("%s: unsupported layout (%d chunks)\n", filename, layout->data_chunks);
+        return;
+    }
+    if (layout->codec != CODEC_NONE && layout->codec != CODEC_LZ4) {
+        printf("%s: stored with an unknown codec (%d)\n", filename, layout->codec);
+        return;
+    }
+    
+    char part_path[MAX_FILENAME + 16];
+    snprintf(part_path, sizeof(part_path), "%s.part", filename);
+    int output_fd = open(part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        perror("error creating output file");
+        return;
+    }
+    if (layout->file_size > 0 && fallocate(output_fd, FALLOC_FL_KEEP_SIZE, 0, layout->file_size) < 0 && errno != EOPNOTSUPP) {
+        perror("could not preallocate output file");
+    }
+    
+    long expected[MAX_CHUNKS];
+    long chunk_len[MAX_CHUNKS] = {0};
+    layout_chunk_len(layout, expected);
+    
+    GetPiece pieces[MAX_CHUNKS];
+    for (int c = 0; c < layout->data_chunks; c++) {
+        GetPiece *piece = &pieces[c];
+        memset(piece, 0, sizeof(*piece));
+        piece->chunk = c;
+        piece->offset = (off_t)c * layout->chunk_size;
+        piece->bytes = expected[c];
+        for (int r = 0; r < layout->replicas; r++) {
+            piece->sources[piece->source_count++] = layout_server(layout, server_list, filename, c, r);
+        }
+    }
+    
+    long slot = layout->codec ? packed_bound(layout->chunk_size) : (long)layout->chunk_size;
+    if (fetch_pieces(server_list, filename, output_fd, chunk_len, slot, pieces, layout->data_chunks, NULL,
+                     layout->codec) < 0) {
+        printf("%s download failed: no intact copy of some chunk left\n", filename);
+        close(output_fd);
+        unlink(part_path);
+        return;
+    }
+    
+    if (finish_part(output_fd, part_path, filename, layout->file_size) == 0) {
+        printf("file %s downloaded successfully\n", filename);
+    }
+}
+
+// erasure coded put: k data shards straight from the file plus m parity shards computed on the fly,
+//each shard on its own server where there are enough, then the layout record where they landed
+void put_erasure(ServerList *server_list, char *filename, int file_fd, long file_size) {
+    rs_code rs;
+    rs_init(&rs, ec_data, ec_parity);
+    int shards = rs.k + rs.m;
+    long shard_size = (file_size + rs.k - 1) / rs.k;
+    dfs_layout layout = {LAYOUT_ERASURE, rs.k, rs.m, 1, 0, PLACE_RENDEZVOUS, CODEC_NONE, time(NULL), file_size, shard_size};
+    
+    // data shards get their real length, parity is always a full shard
+    long chunk_len[MAX_CHUNKS];
+    layout_chunk_len(&layout, chunk_len);
+    for (int s = rs.k; s < shards; s++) {
+        chunk_len[s] = shard_size;
+    }
+    
+    printf("file %s maps to %d (erasure %d+%d)\n", filename, layout_server(&layout, server_list, filename, 0, 0), rs.k, rs.m);
+    
+    TransferPlan plan;
+    plan_init(&plan, filename, chunk_len, shard_size, file_fd);
+    plan.base.rs = &rs;
+    int unplaced = 0;
+    for (int s = 0; s < shards; s++) {
+        int i = layout_server(&layout, server_list, filename, s, 0);
+        if (!server_list->servers[i].connected) {
+            unplaced++;
+            continue;
+        }
+        plan_add(&plan, server_list, i, s, s < rs.k ? (off_t)s * shard_size : 0, chunk_len[s]);
+    }
+    
+    if (unplaced > rs.m) {
+        printf("%s put failed: %d of %d shards have no server\n", filename, unplaced, shards);
+        return;
+    }
+    
+    plan_windows(&plan);
+    run_transfers(plan.jobs, plan.job_count, put_worker, "upload");
+    
+    int stored[MAX_SERVERS];
+    plan_commit(&plan, server_list, filename, &layout, stored);
+    int lost = 0;
+    for (int s = 0; s < shards; s++) {
+        lost += !stored[layout_server(&layout, server_list, filename, s, 0)];
+    }
+    
+    if (lost > rs.m) {
+        printf("%s put failed: only %d of %d shards stored\n", filename, shards - lost, shards);
+    } else if (lost > 0) {
+        printf("file %s uploaded with %d of %d shards missing\n", filename, lost, shards);
+    } else {
+        printf("file %s uploaded successfully\n", filename);
+    }
+}
+
+// erasure coded get: any k shards, data shards first
+//a missing data shard's region of the output receives a parity shard instead; once everything
+//is in, the missing data is decoded in place a stripe at a time
+void get_erasure(ServerList *server_list, char *filename, const dfs_layout *layout) {
+    rs_code rs;
+    if (rs_init(&rs, layout->data_chunks, layout->parity_chunks) < 0) {
+        printf("%s: unsupported erasure layout %d+%d\n", filename, layout->data_chunks, layout->parity_chunks);
+        return;
+    }
+    int shards = rs.k + rs.m;
+    long shard_size = layout->chunk_size;
+    
+    // region r of the output (at r * shard_size) receives shard rows[r]
+    int rows[MAX_CHUNKS];
+    int missing[MAX_CHUNKS];
+    int missing_count = 0;
+    int next_parity = rs.k;
+    for (int r = 0; r < rs.k; r++) {
+        rows[r] = r;
+        if (!server_list->servers[layout_server(layout, server_list, filename, r, 0)].connected) {
+            while (next_parity < shards &&
+                   !server_list->servers[layout_server(layout, server_list, filename, next_parity, 0)].connected) {
+                next_parity++;
+            }
+            if (next_parity == shards) {
+                printf("%s is incomplete\n", filename);
+                return;
+            }
+            rows[r] = next_parity++;
+        }
+    }
+    
+    char part_path[MAX_FILENAME + 16];
+    snprintf(part_path, sizeof(part_path), "%s.part", filename);
+    int output_fd = open(part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        perror("error creating output file");
+        return;
+    }
+    if (shard_size > 0 && fallocate(output_fd, FALLOC_FL_KEEP_SIZE, 0, rs.k * shard_size) < 0 && errno != EOPNOTSUPP) {
+        perror("could not preallocate output file");
+    }
+    
+    long chunk_len[MAX_CHUNKS] = {0};
+    GetPiece pieces[MAX_CHUNKS];
+    for (int r = 0; r < rs.k; r++) {
+        memset(&pieces[r], 0, sizeof(pieces[r]));
+        pieces[r].chunk = rows[r];
+        pieces[r].offset = (off_t)r * shard_size;
+        pieces[r].bytes = shard_size;
+        pieces[r].sources[0] = layout_server(layout, server_list, filename, rows[r], 0);
+        pieces[r].source_count = 1;
+    }
+    
+    // a shard that fails (or fails its checksum) is replaced by the next unused parity shard
+    int ok = 1;
+    while (fetch_pieces(server_list, filename, output_fd, chunk_len, shard_size, pieces, rs.k, NULL, CODEC_NONE) < 0) {
+        for (int r = 0; ok && r < rs.k; r++) {
+            if (pieces[r].done) continue;
+            while (next_parity < shards &&
+                   !server_list->servers[layout_server(layout, server_list, filename, next_parity, 0)].connected) {
+                next_parity++;
+            }
+            if (next_parity == shards) {
+                printf("%s download failed: fewer than %d intact shards\n", filename, rs.k);
+                ok = 0;
+                break;
+            }
+            printf("shard %d: using parity shard %d instead\n", pieces[r].chunk + 1, next_parity + 1);
+            rows[r] = next_parity++;
+            pieces[r].chunk = rows[r];
+            pieces[r].sources[0] = layout_server(layout, server_list, filename, rows[r], 0);
+            pieces[r].tried = 0;
+        }
+        if (!ok) break;
+    }
+    missing_count = 0;
+    for (int r = 0; r < rs.k; r++) {
+        if (rows[r] != r) missing[missing_count++] = r;
+    }
+    
+    // rebuild the missing data shards, stripe by stripe
+    //(bytes past the end of a short shard read as zero, which is how they were encoded)
+    if (ok && missing_count > 0) {
+        uint8_t decode[MAX_CHUNKS * MAX_CHUNKS];
+        long stripe = buffer_budget / (rs.k + missing_count);
+        if (stripe < 4096) stripe = 4096;
+        uint8_t *buf = malloc((rs.k + missing_count) * stripe);
+        ok = buf != NULL && rs_decoder(&rs, rows, decode) == 0;
+        
+        const uint8_t *src[MAX_CHUNKS];
+        uint8_t *out[MAX_CHUNKS];
+        for (int r = 0; ok && r < rs.k + missing_count; r++) {
+            if (r < rs.k) src[r] = buf + r * stripe;
+            else out[r - rs.k] = buf + r * stripe;
+        }
+        
+        for (long pos = 0; ok && pos < shard_size; pos += stripe) {
+            long span = shard_size - pos < stripe ? shard_size - pos : stripe;
+            for (int r = 0; ok && r < rs.k; r++) {
+                ssize_t got = pread(output_fd, (uint8_t *)src[r], span, (off_t)r * shard_size + pos);
+                ok = got >= 0;
+                if (ok) memset((uint8_t *)src[r] + got, 0, span - got);
+            }
+            for (int j = 0; ok && j < missing_count; j++) {
+                rs_combine(decode + missing[j] * rs.k, rs.k, src, out[j], span);
+            }
+            for (int j = 0; ok && j < missing_count; j++) {
+                ok = pwrite(output_fd, out[j], span, (off_t)missing[j] * shard_size + pos) == span;
+            }
+        }
+        free(buf);
+        if (ok) {
+            printf("rebuilt %d data shard%s from parity (%s)\n", missing_count, missing_count > 1 ? "s" : "", gf_kernel_name());
+        }
+    }
+    
+    if (!ok) {
+        close(output_fd);
+        unlink(part_path);
+        return;
+    }
+    if (finish_part(output_fd, part_path, filename, layout->file_size) == 0) {
+        printf("file %s downloaded successfully\n", filename);
+    }
+}
+
+// fill the gear table from splitmix64 with a fixed seed, so every client cuts the same data at the
+//same places (which is what makes two uploads of shared content name the same chunks)
+void gear_init(void) {
+    uint64_t x = 0x6466732d63646331ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gear_ready = 1;
+}
+
+// FastCDC: length of the next chunk of data (len bytes left), for chunks of about avg bytes
+//nothing is cut before avg/4, a gear hash (one shift and add per byte, its top bits covering the
+//last 64 bytes) is tested against a mask 2 bits harder than avg needs until avg and 2 bits easier
+//after it, which keeps most chunks near avg, and a cut is forced at 4 x avg. the cut depends only
+//on nearby content, so an insert early in a file moves the cuts around it and leaves the rest alone
+long cdc_cut(const unsigned char *data, long len, long avg) {
+    long min = avg / 4, max = avg * 4;
+    if (len <= min) {
+        return len;
+    }
+    if (len > max) {
+        len = max;
+    }
+    int bits = __builtin_ctzl(avg);
+    uint64_t hard = ~0ULL << (64 - (bits + 2));
+    uint64_t easy = ~0ULL << (64 - (bits - 2));
+    long normal = avg < len ? avg : len;
+    uint64_t hash = 0;
+    long i = min;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & hard)) return i + 1;
+    }
+    for (; i < len; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & easy)) return i + 1;
+    }
+    return len;
+}
+
+// '@' + hex sha-256, the name a content chunk is stored under
+void content_name(const unsigned char *digest, char *name) {
+    name[0] = '@';
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        sprintf(name + 1 + 2 * i, "%02x", digest[i]);
+    }
+}
+
+int is_content_name(const char *name) {
+    if (name[0] != '@' || strlen(name) != DEDUP_NAME - 1) {
+        return 0;
+    }
+    return strspn(name + 1, "0123456789abcdef") == DEDUP_NAME - 2;
+}
+
+int cmp_names(const void *a, const void *b, void *names) {
+    char (*n)[DEDUP_NAME] = names;
+    int diff = strcmp(n[*(const int *)a], n[*(const int *)b]);
+    return diff ? diff : *(const int *)a - *(const int *)b;
+}
+
+// room for capacity chunks (count left at 0); -1 if out of memory, the list can be freed either way
+int content_alloc(ContentList *list, long capacity) {
+    memset(list, 0, sizeof(*list));
+    capacity++;
+    list->len = malloc(capacity * sizeof(long));
+    list->offset = malloc(capacity * sizeof(off_t));
+    list->digest = malloc(capacity * SHA256_DIGEST_LENGTH);
+    list->name = malloc(capacity * DEDUP_NAME);
+    list->first = malloc(capacity * sizeof(int));
+    list->target = malloc(capacity * MAX_SERVERS * sizeof(int));
+    list->have = calloc(capacity * MAX_SERVERS, 1);
+    return list->len && list->offset && list->digest && list->name && list->first && list->target && list->have
+           ? 0 : -1;
+}
+
+void content_free(ContentList *list) {
+    free(list->len);
+    free(list->offset);
+    free(list->digest);
+    free(list->name);
+    free(list->first);
+    free(list->target);
+    free(list->have);
+}
+
+// chunk c's first copy: the first chunk of the file with the same content (itself if none before it)
+//0 ok, -1 if out of memory
+int content_repeats(ContentList *list) {
+    int *order = malloc((list->count + 1) * sizeof(int));
+    if (!order) {
+        return -1;
+    }
+    for (int c = 0; c < list->count; c++) {
+        order[c] = c;
+    }
+    qsort_r(order, list->count, sizeof(int), cmp_names, list->name);
+    for (int k = 0; k < list->count; k++) {
+        int same = k > 0 && strcmp(list->name[order[k]], list->name[order[k - 1]]) == 0;
+        list->first[order[k]] = same ? list->first[order[k - 1]] : order[k];
+    }
+    free(order);
+    return 0;
+}
+
+// cut file_size bytes of fd into content chunks of about dedup_avg bytes and hash them; -1 on error
+int content_cut(ContentList *list, int fd, long file_size) {
+    if (content_alloc(list, file_size / (dedup_avg / 4) + 1) < 0) {
+        return -1;
+    }
+    unsigned char *map = file_size > 0 ? mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (!gear_ready) {
+        gear_init();
+    }
+    
+    madvise(map, file_size, MADV_SEQUENTIAL);
+    for (long pos = 0; pos < file_size; list->count++) {
+        int c = list->count;
+        list->len[c] = cdc_cut(map + pos, file_size - pos, dedup_avg);
+        list->offset[c] = pos;
+        SHA256(map + pos, list->len[c], list->digest[c]);
+        content_name(list->digest[c], list->name[c]);
+        if (list->len[c] > list->longest) list->longest = list->len[c];
+        pos += list->len[c];
+    }
+    if (map) munmap(map, file_size);
+    return content_repeats(list);
+}
+
+// recipe of a list: magic, count, (sha-256, length) per chunk, crc32c (see dfs_proto.h); malloc'd
+char *content_recipe(const ContentList *list, long *len) {
+    *len = 8 + (long)list->count * DFS_RECIPE_ENTRY + 4;
+    unsigned char *recipe = malloc(*len);
+    if (!recipe) {
+        return NULL;
+    }
+    memcpy(recipe, DFS_RECIPE_MAGIC, 4);
+    dfs_put32(recipe + 4, list->count);
+    for (int c = 0; c < list->count; c++) {
+        memcpy(recipe + 8 + c * DFS_RECIPE_ENTRY, list->digest[c], SHA256_DIGEST_LENGTH);
+        dfs_put64(recipe + 8 + c * DFS_RECIPE_ENTRY + SHA256_DIGEST_LENGTH, list->len[c]);
+    }
+    dfs_put32(recipe + *len - 4, crc32c(0, recipe, *len - 4));
+    return (char *)recipe;
+}
+
+// a list back from its recipe (chunk offsets follow from the lengths); -1 if it is damaged or
+//memory runs out, the list can be freed either way
+int content_parse(ContentList *list, const unsigned char *recipe, long len) {
+    int count = len >= 12 ? (len - 12) / DFS_RECIPE_ENTRY : 0;
+    if (content_alloc(list, count) < 0 || len < 12 || memcmp(recipe, DFS_RECIPE_MAGIC, 4) != 0 ||
+        dfs_get32(recipe + 4) != (uint32_t)count || len != 12 + (long)count * DFS_RECIPE_ENTRY ||
+        crc32c(0, recipe, len - 4) != dfs_get32(recipe + len - 4)) {
+        return -1;
+    }
+    
+    off_t offset = 0;
+    for (int c = 0; c < count; c++) {
+        const unsigned char *entry = recipe + 8 + c * DFS_RECIPE_ENTRY;
+        memcpy(list->digest[c], entry, SHA256_DIGEST_LENGTH);
+        content_name(entry, list->name[c]);
+        list->len[c] = dfs_get64(entry + SHA256_DIGEST_LENGTH);
+        list->offset[c] = offset;
+        if (list->len[c] > list->longest) list->longest = list->len[c];
+        offset += list->len[c];
+    }
+    list->count = count;
+    return content_repeats(list);
+}
+
+// which of the content chunks names[which[0..count-1]] server holds (have[k] = 1): CHECK requests
+//kept CHECK_WINDOW deep on a binary connection and matched to replies by request id, one at a time
+//on a text one; -1 if the connection fails
+int server_have(Server *server, char (*names)[DEDUP_NAME], const int *which, int count, char *have) {
+    if (!server->binary) {
+        for (int k = 0; k < count; k++) {
+            have[k] = server_check(server, names[which[k]]);
+        }
+        return 0;
+    }
+    
+    uint32_t first_id = server->next_id + 1;
+    int sent = 0;
+    for (int received = 0; received < count; received++) {
+        while (sent < count && sent - received < CHECK_WINDOW) {
+            if (send_request(server, OP_CHECK, names[which[sent]], 0, 0, NULL) < 0) {
+                return -1;
+            }
+            sent++;
+        }
+        dfs_frame response;
+        if (recv_response(server, &response) < 0 || response.request_id - first_id >= (uint32_t)count) {
+            return -1;
+        }
+        have[response.request_id - first_id] = response.status == ST_OK;
+    }
+    return 0;
+}
+
+// where each distinct chunk of the list belongs (its `replicas` rendezvous servers by name, over all
+//servers) and which of those hold it already, asking every server about its share at once
+//a server that can't answer is dropped for the rest of the run
+void content_holders(ServerList *server_list, ContentList *list, int replicas) {
+    dfs_layout content = {LAYOUT_REPLICATED, 1, 0, replicas, 0, PLACE_RENDEZVOUS, CODEC_NONE, 0, 0, 0};
+    for (int c = 0; c < list->count; c++) {
+        for (int r = 0; r < replicas && list->first[c] == c; r++) {
+            list->target[c * MAX_SERVERS + r] = rendezvous_server(&content, server_list, list->name[c], 0, r);
+        }
+    }
+    
+    int *asked = malloc((list->count + 1) * sizeof(int));
+    int *slot = malloc((list->count + 1) * sizeof(int));
+    char *answers = malloc(list->count + 1);
+    for (int i = 0; asked && slot && answers && i < server_list->count; i++) {
+        Server *server = &server_list->servers[i];
+        int count = 0;
+        for (int c = 0; c < list->count && server->connected; c++) {
+            for (int r = 0; r < replicas && list->first[c] == c; r++) {
+                if (list->target[c * MAX_SERVERS + r] == i) {
+                    asked[count] = c;
+                    slot[count++] = c * MAX_SERVERS + r;
+                }
+            }
+        }
+        if (count == 0) continue;
+        
+        if (server_have(server, list->name, asked, count, answers) < 0) {
+            printf("server %s: could not ask which chunks it holds, leaving it out\n", server->hostname);
+            close(server->socket);
+            server->connected = 0;
+            continue;
+        }
+        for (int k = 0; k < count; k++) {
+            list->have[slot[k]] = answers[k];
+        }
+    }
+    free(asked);
+    free(slot);
+    free(answers);
+}
+
+// copies of distinct chunk c the servers it belongs on hold
+int content_copies(const ContentList *list, int c, int replicas) {
+    int held = 0;
+    for (int r = 0; r < replicas; r++) {
+        held += list->have[c * MAX_SERVERS + r];
+    }
+    return held;
+}
+
+// deduplicated put: cut the file into content defined chunks named by their sha-256, ask the servers
+//each chunk belongs on which ones they hold already, and upload only the missing copies, every
+//server's share streamed through its connection a batch at a time. with every chunk stored
+//somewhere, the recipe goes to the file's own servers and the layout record to everyone
+void put_dedup(ServerList *server_list, char *filename, int file_fd, long file_size) {
+    ContentList list;
+    if (content_cut(&list, file_fd, file_size) < 0) {
+        perror("Error reading file");
+        content_free(&list);
+        return;
+    }
+    
+    int replicas = replica_count < server_list->count ? replica_count : server_list->count;
+    content_holders(server_list, &list, replicas);
+    int distinct = 0, stored_before = 0;
+    for (int c = 0; c < list.count; c++) {
+        distinct += list.first[c] == c;
+        stored_before += list.first[c] == c && content_copies(&list, c, replicas) == replicas;
+    }
+    printf("file %s: %d chunks, %d distinct, %d of those stored already\n", filename, list.count, distinct,
+           stored_before);
+    
+    // upload the missing copies, each server's streamed through its connection
+    TransferPlan plan;
+    plan_init(&plan, filename, list.len, list.longest, file_fd);
+    plan.base.names = list.name;
+    plan.batch = put_worker;
+    int queued_ok = 1;
+    for (int c = 0; c < list.count && queued_ok; c++) {
+        for (int r = 0; r < replicas && list.first[c] == c && queued_ok; r++) {
+            int i = list.target[c * MAX_SERVERS + r];
+            if (!list.have[c * MAX_SERVERS + r] && server_list->servers[i].connected) {
+                queued_ok = plan_queue(&plan, server_list, i, c, list.offset[c], list.len[c], -1) == 0;
+            }
+        }
+    }
+    if (!queued_ok) {
+        perror("memory allocation failed");
+    } else if (plan.job_count > 0) {
+        plan_windows(&plan);
+        run_transfers(plan.jobs, plan.job_count, stream_worker, "upload");
+    }
+    long sent_bytes = 0;
+    for (int j = 0; j < plan.job_count && queued_ok; j++) {
+        ChunkQueue *queue = plan.jobs[j].queue;
+        for (int k = 0; k < queue->count; k++) {
+            int c = queue->chunks[k];
+            for (int r = 0; r < replicas && !queue->bad[k]; r++) {
+                if (list.target[c * MAX_SERVERS + r] == plan.jobs[j].server_index) {
+                    list.have[c * MAX_SERVERS + r] = 1;
+                }
+            }
+            sent_bytes += queue->bad[k] ? 0 : list.len[c];
+        }
+    }
+    plan_free(&plan);
+    
+    int lost = 0, degraded = 0;
+    for (int c = 0; c < list.count; c++) {
+        int copies = list.first[c] == c ? content_copies(&list, c, replicas) : replicas;
+        lost += copies == 0;
+        degraded += copies > 0 && copies < replicas;
+    }
+    long recipe_len;
+    char *recipe = lost == 0 ? content_recipe(&list, &recipe_len) : NULL;
+    content_free(&list);
+    if (lost > 0) {
+        printf("%s put failed: %d of %d chunks not stored\n", filename, lost, distinct);
+        return;
+    }
+    if (!recipe) {
+        perror("memory allocation failed");
+        return;
+    }
+    
+    // the recipe is the file's chunk 1, on the file's own servers like any replicated chunk
+    dfs_layout layout;
+    plan_layout(file_size, server_list->count, &layout);
+    layout.scheme = LAYOUT_DEDUP;
+    layout.data_chunks = 1;
+    layout.chunk_size = recipe_len;
+    int recipes = 0, layouts = 0;
+    for (int r = 0; r < layout.replicas; r++) {
+        Server *server = &server_list->servers[layout_server(&layout, server_list, filename, 0, r)];
+        recipes += server->connected && put_small(server, filename, 1, recipe, recipe_len) == 0;
+    }
+    for (int i = 0; i < server_list->count && recipes > 0; i++) {
+        Server *server = &server_list->servers[i];
+        layouts += server->connected && put_layout(server, filename, &layout) == 0;
+    }
+    free(recipe);
+    
+    if (layouts == 0) {
+        printf("%s put failed: its recipe could not be stored\n", filename);
+    } else if (degraded > 0 || recipes < layout.replicas) {
+        printf("file %s uploaded with %d chunk(s) short of %d replicas (%ld bytes sent)\n", filename,
+               degraded + (recipes < layout.replicas), layout.replicas, sent_bytes);
+    } else {
+        printf("file %s uploaded successfully (%ld bytes sent for %ld, replicas included)\n", filename, sent_bytes,
+               file_size);
+    }
 }
 
-// implememt GET command
-void get_file(ServerList *server_list, char *filename) {
-    // check if enough chunks to reconstruct the file
-    if (!check_file_completeness(server_list, filename)) {
-        printf("%s is incomplete\n", filename);
+// a deduplicated file's recipe from the first of its servers with an intact one that adds up to the
+//file; 0 ok (list filled in, content_free it), -1 if there is none
+int load_recipe(ServerList *server_list, char *filename, const dfs_layout *layout, ContentList *list) {
+    long recipe_len = layout->chunk_size;
+    unsigned char *recipe = recipe_len < (1L << 30) ? malloc(recipe_len + 1) : NULL;
+    memset(list, 0, sizeof(*list));
+    int parsed = 0;
+    for (int r = 0; r < layout->replicas && recipe && !parsed; r++) {
+        Server *server = &server_list->servers[layout_server(layout, server_list, filename, 0, r)];
+        parsed = server->connected && fetch_small(server, filename, 1, (char *)recipe, recipe_len) == recipe_len &&
+                 content_parse(list, recipe, recipe_len) == 0 &&
+                 (list->count ? list->offset[list->count - 1] + list->len[list->count - 1] : 0) == (long)layout->file_size;
+        if (!parsed) {
+            content_free(list);
+            memset(list, 0, sizeof(*list));
+        }
+    }
+    free(recipe);
+    return parsed ? 0 : -1;
+}
+
+// deduplicated get: the recipe from the first of its servers with an intact one, then each distinct
+//chunk like the chunks of a replicated file (fastest replica, hedging, fallback), streamed from every
+//server at once; a chunk that appears again further on is copied locally
+void get_dedup(ServerList *server_list, char *filename, const dfs_layout *layout) {
+    ContentList list;
+    if (load_recipe(server_list, filename, layout, &list) < 0) {
+        printf("%s download failed: no intact copy of its recipe left\n", filename);
+        return;
+    }
+    long total = (long)layout->file_size;
+    
+    char part_path[MAX_FILENAME + 16];
+    snprintf(part_path, sizeof(part_path), "%s.part", filename);
+    int output_fd = open(part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    GetPiece *pieces = malloc((list.count + 1) * sizeof(GetPiece));
+    long *chunk_len = calloc(list.count + 1, sizeof(long));
+    if (output_fd < 0 || !pieces || !chunk_len) {
+        perror("error creating output file");
+        if (output_fd >= 0) close(output_fd);
+        free(pieces);
+        free(chunk_len);
+        content_free(&list);
         return;
     }
+    if (total > 0 && fallocate(output_fd, FALLOC_FL_KEEP_SIZE, 0, total) < 0 && errno != EOPNOTSUPP) {
+        perror("could not preallocate output file");
+    }
     
-    unsigned int hash = get_file_hash(filename);
-    int x = hash % server_list->count;
+    dfs_layout content = {LAYOUT_REPLICATED, 1, 0, layout->replicas, 0, PLACE_RENDEZVOUS, CODEC_NONE, 0, 0, 0};
+    int replicas = layout->replicas < server_list->count ? layout->replicas : server_list->count;
+    int piece_count = 0;
+    for (int c = 0; c < list.count; c++) {
+        if (list.first[c] != c) continue;
+        GetPiece *piece = &pieces[piece_count++];
+        memset(piece, 0, sizeof(*piece));
+        piece->chunk = c;
+        piece->offset = list.offset[c];
+        piece->bytes = list.len[c];
+        for (int r = 0; r < replicas; r++) {
+            piece->sources[piece->source_count++] = rendezvous_server(&content, server_list, list.name[c], 0, r);
+        }
+    }
     
-    int chunk_pairs[4][2] = {
-        {0, 1}, {1, 2}, {2, 3}, {3, 0} 
-    };
+    int failed = fetch_pieces(server_list, filename, output_fd, chunk_len, list.longest, pieces, piece_count,
+                              list.name, CODEC_NONE) < 0;
+    if (failed) {
+        printf("%s download failed: no intact copy of some chunk left\n", filename);
+    }
     
-   
-    for (int i = 0; i < x; i++) {
-        int temp1 = chunk_pairs[0][0];
-        int temp2 = chunk_pairs[0][1];
-        
-        for (int j = 0; j < 3; j++) {
-            chunk_pairs[j][0] = chunk_pairs[j+1][0];
-            chunk_pairs[j][1] = chunk_pairs[j+1][1];
+    // a chunk that appears again is copied from its first place
+    char buf[BUFFER_SIZE * 16];
+    for (int c = 0; c < list.count && !failed; c++) {
+        int first = list.first[c];
+        if (first == c ? chunk_len[c] != list.len[c]
+                       : copy_region(output_fd, list.offset[first], list.offset[c], list.len[c], buf, sizeof(buf)) < 0) {
+            printf("%s download failed: chunk %d came back wrong\n", filename, c + 1);
+            failed = 1;
         }
-        
-        chunk_pairs[3][0] = temp1;
-        chunk_pairs[3][1] = temp2;
     }
     
-    // get chunk size
-    //get size from first server with file
-    long chunk_size = 0;
-    for (int i = 0; i < server_list->count; i++) {
-        if (server_list->servers[i].connected) {
-            // send SIZE command
-            char command[BUFFER_SIZE];
-            sprintf(command, "SIZE %s", filename);
-            send(server_list->servers[i].socket, command, strlen(command), 0);
-            
-            // get response
-            char buffer[BUFFER_SIZE];
-            int received = recv(server_list->servers[i].socket, buffer, BUFFER_SIZE, 0);
-            if (received > 0) {
-                buffer[received] = '\0';
-                if (strncmp(buffer, "SIZE ", 5) == 0) {
-                    chunk_size = atol(buffer + 5);
-                    break;
-                }
+    if (failed) {
+        close(output_fd);
+        unlink(part_path);
+    } else if (finish_part(output_fd, part_path, filename, total) == 0) {
+        printf("file %s downloaded successfully\n", filename);
+    }
+    free(pieces);
+    free(chunk_len);
+    content_free(&list);
+}
+
+// piece for the part of a chunk (chunk_len bytes at chunk_start in the file) that falls in the read
+//[start, start + len), going to its place in the output; 0 if they don't overlap
+int range_piece(GetPiece *piece, int chunk, long chunk_start, long chunk_len, long start, long len) {
+    long from = start > chunk_start ? start - chunk_start : 0;
+    long end = start + len < chunk_start + chunk_len ? start + len - chunk_start : chunk_len;
+    if (from >= end) {
+        return 0;
+    }
+    memset(piece, 0, sizeof(*piece));
+    piece->chunk = chunk;
+    piece->ranged = 1;
+    piece->from = from;
+    piece->bytes = end - from;
+    piece->offset = chunk_start + from - start;
+    return 1;
+}
+
+// implementing READ command: len bytes of filename from start into output, without the rest of the file
+//each chunk the range touches is asked for just its part of it (a ranged GET), from the fastest of
+//its replicas with the others to fall back on, like a get. erasure coded files are read from their
+//data shards, so a missing one fails the read (get rebuilds it from parity); LZ4 blocks can't be
+//entered midway, so a compressed file's chunks come whole and the range is cut out of them
+void read_file(ServerList *server_list, char *filename, long start, long len, const char *output) {
+    dfs_layout layout;
+    if (fetch_layout(server_list, filename, &layout) < 0) {
+        printf("%s read failed: no layout record (not stored, or in the original layout: use get)\n", filename);
+        return;
+    }
+    if (layout.scheme != LAYOUT_DEDUP && (layout.data_chunks < 1 || layout.data_chunks > MAX_CHUNKS)) {
+        printf("%s: unsupported layout (%d chunks)\n", filename, layout.data_chunks);
+        return;
+    }
+    if (layout.codec != CODEC_NONE && layout.codec != CODEC_LZ4) {
+        printf("%s: stored with an unknown codec (%d)\n", filename, layout.codec);
+        return;
+    }
+    if (start > (long)layout.file_size) start = layout.file_size;
+    if (len > (long)layout.file_size - start) len = layout.file_size - start;
+    
+    ContentList list;
+    memset(&list, 0, sizeof(list));
+    if (layout.scheme == LAYOUT_DEDUP && load_recipe(server_list, filename, &layout, &list) < 0) {
+        printf("%s read failed: no intact copy of its recipe left\n", filename);
+        return;
+    }
+    int chunks = layout.scheme == LAYOUT_DEDUP ? list.count : layout.data_chunks;
+    
+    char part_path[MAX_FILENAME + 16];
+    snprintf(part_path, sizeof(part_path), "%s.part", output);
+    int output_fd = open(part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    int scratch = layout.codec == CODEC_LZ4 ? open(dir, O_TMPFILE | O_RDWR, 0600) : -1;
+    GetPiece *pieces = malloc((chunks + 1) * sizeof(GetPiece));
+    long *chunk_len = calloc(chunks + 1, sizeof(long));
+    if (output_fd < 0 || (layout.codec == CODEC_LZ4 && scratch < 0) || !pieces || !chunk_len) {
+        perror("error creating output file");
+        if (output_fd >= 0) close(output_fd);
+        if (scratch >= 0) close(scratch);
+        free(pieces);
+        free(chunk_len);
+        content_free(&list);
+        return;
+    }
+    
+    // the pieces: the part of each chunk in the range, or for a compressed file each whole chunk in
+    //its place in the scratch file, the first at 0
+    long expected[MAX_CHUNKS];
+    if (layout.scheme != LAYOUT_DEDUP) {
+        layout_chunk_len(&layout, expected);
+    }
+    dfs_layout content = {LAYOUT_REPLICATED, 1, 0, layout.replicas, 0, PLACE_RENDEZVOUS, CODEC_NONE, 0, 0, 0};
+    int replicas = layout.replicas < server_list->count ? layout.replicas : server_list->count;
+    int count = 0;
+    long slot = 0, fetched = 0;
+    off_t skip = 0;
+    for (int c = 0; c < chunks && len > 0; c++) {
+        GetPiece *piece = &pieces[count];
+        if (layout.scheme == LAYOUT_DEDUP) {
+            if (!range_piece(piece, c, list.offset[c], list.len[c], start, len)) continue;
+            for (int r = 0; r < replicas; r++) {
+                piece->sources[piece->source_count++] = rendezvous_server(&content, server_list, list.name[c], 0, r);
             }
+        } else {
+            long chunk_start = c * (long)layout.chunk_size;
+            if (!range_piece(piece, c, chunk_start, expected[c], start, len)) continue;
+            if (layout.codec == CODEC_LZ4) {
+                if (count == 0) skip = start - chunk_start;
+                piece->ranged = 0;
+                piece->from = 0;
+                piece->bytes = expected[c];
+                piece->offset = chunk_start - (start - skip);
+            }
+            int copies = layout.scheme == LAYOUT_ERASURE ? 1 : layout.replicas;
+            for (int r = 0; r < copies; r++) {
+                piece->sources[piece->source_count++] = layout_server(&layout, server_list, filename, c, r);
+            }
+        }
+        if (piece->bytes > slot) slot = piece->bytes;
+        fetched += piece->bytes;
+        count++;
+    }
+    if (layout.codec == CODEC_LZ4) {
+        slot = packed_bound(layout.chunk_size);
+    }
+    
+    int failed = fetch_pieces(server_list, filename, scratch >= 0 ? scratch : output_fd, chunk_len, slot, pieces,
+                              count, layout.scheme == LAYOUT_DEDUP ? list.name : NULL, layout.codec) < 0;
+    for (loff_t from = skip, to = 0; !failed && scratch >= 0 && to < len; ) {
+        ssize_t copied = copy_file_range(scratch, &from, output_fd, &to, len - to, 0);
+        if (copied <= 0) {
+            perror("error writing output file");
+            failed = 1;
         }
     }
     
-    if (chunk_size == 0) {
-        printf("error: could not determine chunk size\n");
+    if (failed) {
+        printf("%s read failed: no intact copy of some chunk left%s\n", filename,
+               layout.scheme == LAYOUT_ERASURE ? " (get rebuilds a lost shard from parity)" : "");
+        close(output_fd);
+        unlink(part_path);
+    } else if (finish_part(output_fd, part_path, output, len) == 0) {
+        printf("read %ld bytes of %s from byte %ld into %s (%ld bytes of %d chunk(s) fetched)\n", len, filename,
+               start, output, fetched, count);
+    }
+    if (scratch >= 0) close(scratch);
+    free(pieces);
+    free(chunk_len);
+    content_free(&list);
+}
+
+// implementing INFO command: how each file is laid out, from its layout record
+void info_file(ServerList *server_list, char *filename) {
+    dfs_layout layout;
+    if (fetch_layout(server_list, filename, &layout) < 0) {
+        printf("%s: no layout record (original 4 chunk, 2 replica layout, or not stored)\n", filename);
         return;
     }
     
-    // allocate memory for chunks
-    char *chunks[4] = {NULL, NULL, NULL, NULL};
-    for (int i = 0; i < 4; i++) {
-        chunks[i] = malloc(chunk_size);
-        if (!chunks[i]) {
-            perror("memory allocation failed");
-            for (int j = 0; j < i; j++) {
-                free(chunks[j]);
+    char spread[64];
+    if (layout.width) {
+        snprintf(spread, sizeof(spread), "over %d servers", layout.width);
+    } else {
+        snprintf(spread, sizeof(spread), "over all servers");
+    }
+    const char *placement = layout.placement == PLACE_RENDEZVOUS ? "rendezvous" : "ring";
+    if (layout.scheme == LAYOUT_ERASURE) {
+        printf("%s: %llu bytes, erasure %d+%d, %llu byte shards %s (%s)\n", filename,
+               (unsigned long long)layout.file_size, layout.data_chunks, layout.parity_chunks,
+               (unsigned long long)layout.chunk_size, spread, placement);
+    } else if (layout.scheme == LAYOUT_DEDUP) {
+        printf("%s: %llu bytes, deduplicated into %llu content chunks, recipe %s, %d replicas (%s)\n", filename,
+               (unsigned long long)layout.file_size,
+               (unsigned long long)((layout.chunk_size - 12) / DFS_RECIPE_ENTRY), spread, layout.replicas, placement);
+    } else {
+        printf("%s: %llu bytes, %d chunks of %llu bytes %s, %d replicas (%s)%s\n", filename,
+               (unsigned long long)layout.file_size, layout.data_chunks, (unsigned long long)layout.chunk_size,
+               spread, layout.replicas, placement, layout.codec == CODEC_LZ4 ? ", lz4 compressed" : "");
+    }
+}
+
+// append a file to a server's listing (takes ownership of name), NULL if out of memory
+ListedFile *add_listed(ListJob *job, char *name, int implied) {
+    if (job->count == job->capacity) {
+        int capacity = job->capacity ? job->capacity * 2 : 256;
+        ListedFile *files = realloc(job->files, capacity * sizeof(ListedFile));
+        if (!files) {
+            free(name);
+            job->failed = 1;
+            return NULL;
+        }
+        job->files = files;
+        job->capacity = capacity;
+    }
+    if (!name) {
+        job->failed = 1;
+        return NULL;
+    }
+    
+    ListedFile *file = &job->files[job->count++];
+    file->name = name;
+    file->server = job->index;
+    file->chunks = 0;
+    file->implied = implied;
+    file->has_layout = 0;
+    file->chunk_size = 0;
+    return file;
+}
+
+// fetch one server's listing: extended (chunk numbers + sizes) from binary servers,
+//names only from text servers or binary servers that predate OP_LIST_CHUNKS
+void *list_worker(void *arg) {
+    ListJob *job = (ListJob *)arg;
+    Server *server = job->server;
+    int extended = server->binary;
+    
+    if (extended) {
+        dfs_frame response;
+        uint32_t id;
+        unsigned char *batch = NULL;
+        if (send_request(server, OP_LIST_CHUNKS, NULL, 0, 0, &id) < 0) {
+            job->failed = 1;
+            return NULL;
+        }
+        do {
+            if (recv_response(server, &response) < 0 || response.request_id != id || response.length > (1 << 24)) {
+                job->failed = 1;
+                break;
             }
-            return;
+            if (response.status == ST_BAD_REQUEST) {
+                extended = 0;  // older server, ask for names
+                break;
+            }
+            
+            unsigned char *grown = realloc(batch, response.length ? response.length : 1);
+            if (!grown || recv_all(server->socket, (char *)grown, response.length, NULL) < 0) {
+                batch = grown ? grown : batch;
+                job->failed = 1;
+                break;
+            }
+            batch = grown;
+            
+            // u16 name_len, name, u16 chunk_count, chunk_count x (u32 chunk, u64 size), u16 layout_len, layout
+            unsigned char *p = batch, *end = batch + response.length;
+            while (end - p >= 4) {
+                int name_len = dfs_get16(p);
+                if (name_len >= MAX_FILENAME || end - p < 4 + name_len) break;
+                int chunk_count = dfs_get16(p + 2 + name_len);
+                unsigned char *chunks = p + 4 + name_len;
+                if (end - chunks < (long)chunk_count * DFS_RECORD_CHUNK_SIZE) break;
+                
+                unsigned char *layout = chunks + (long)chunk_count * DFS_RECORD_CHUNK_SIZE;
+                if (end - layout < 2 || end - layout < 2 + dfs_get16(layout)) break;
+                
+                ListedFile *file = add_listed(job, strndup((char *)p + 2, name_len), 0);
+                if (!file) break;
+                for (int c = 0; c < chunk_count; c++) {
+                    uint32_t num = dfs_get32(chunks + c * DFS_RECORD_CHUNK_SIZE);
+                    uint64_t size = dfs_get64(chunks + c * DFS_RECORD_CHUNK_SIZE + 4);
+                    if (num >= 1 && num <= 64) file->chunks |= 1UL << (num - 1);
+                    if (num >= 1 && (long)size > file->chunk_size) file->chunk_size = size;
+                }
+                file->has_layout = dfs_decode_layout(layout + 2, dfs_get16(layout), &file->layout) == 0;
+                p = layout + 2 + dfs_get16(layout);
+            }
+        } while (!job->failed && (response.flags & DFS_FLAG_MORE));
+        free(batch);
+    }
+    
+    if (!extended && !job->failed) {
+        char *names = server_list_names(server);
+        char *save;
+        for (char *line = names ? strtok_r(names, "\n", &save) : NULL; line; line = strtok_r(NULL, "\n", &save)) {
+            if (!add_listed(job, strdup(line), 1)) break;
+        }
+        free(names);
+    }
+    return NULL;
+}
+
+int cmp_listed(const void *a, const void *b) {
+    return strcmp(((const ListedFile *)a)->name, ((const ListedFile *)b)->name);
+}
+
+// every server's listing, fetched in parallel, in one array sorted by name so each file's entries
+//are adjacent; NULL on allocation failure
+ListedFile *gather_listing(ServerList *server_list, int *count) {
+    ListJob jobs[MAX_SERVERS];
+    pthread_t threads[MAX_SERVERS];
+    int total = 0;
+    
+    for (int i = 0; i < server_list->count; i++) {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].server = &server_list->servers[i];
+        jobs[i].index = i;
+        threads[i] = 0;
+        if (server_list->servers[i].connected && pthread_create(&threads[i], NULL, list_worker, &jobs[i]) != 0) {
+            threads[i] = 0;
+        }
+    }
+    for (int i = 0; i < server_list->count; i++) {
+        if (threads[i]) pthread_join(threads[i], NULL);
+        if (jobs[i].failed) {
+            printf("server %s: list failed\n", server_list->servers[i].hostname);
         }
+        total += jobs[i].count;
     }
     
-    // retrieve chunks from servers
+    // everything in one array sorted by name, so each file's entries are adjacent
+    ListedFile *all = malloc((total ? total : 1) * sizeof(ListedFile));
+    int n = 0;
     for (int i = 0; i < server_list->count; i++) {
-        if (!server_list->servers[i].connected) {
+        if (all) {
+            memcpy(all + n, jobs[i].files, jobs[i].count * sizeof(ListedFile));
+            n += jobs[i].count;
+        }
+        free(jobs[i].files);
+    }
+    if (!all) {
+        perror("memory allocation failed");
+        return NULL;
+    }
+    qsort(all, n, sizeof(ListedFile), cmp_listed);
+    *count = n;
+    return all;
+}
+
+// which chunks (bit c = chunk c) a listing entry holds; text servers only give names, so theirs
+//follow from the original placement
+unsigned long listed_chunks(ServerList *server_list, const ListedFile *file) {
+    if (!file->implied) {
+        return file->chunks;
+    }
+    unsigned long held = 0;
+    if (file->server < 4) {
+        int chunk_pairs[4][2];
+        place_chunks(file->name, server_list->count, chunk_pairs);
+        held |= 1UL << chunk_pairs[file->server][0];
+        held |= 1UL << chunk_pairs[file->server][1];
+    }
+    return held;
+}
+
+// implememting LIST command
+//completeness is worked out from what each server reports holding instead of a CHECK round
+//trip per file per server
+void list_files(ServerList *server_list) {
+    int n;
+    ListedFile *all = gather_listing(server_list, &n);
+    if (!all) {
+        return;
+    }
+    
+    // display files
+    int file_count = 0;
+    for (int i = 0; i < n; ) {
+        unsigned long held = 0;
+        const dfs_layout *layout = NULL;
+        int j = i;
+        for (; j < n && strcmp(all[j].name, all[i].name) == 0; j++) {
+            if (all[j].has_layout && (!layout || all[j].layout.stamp > layout->stamp)) layout = &all[j].layout;
+            held |= listed_chunks(server_list, &all[j]);
+        }
+        if (is_content_name(all[i].name)) {
+            // part of some deduplicated file, not one itself
+            for (; i < j; i++) {
+                free(all[i].name);
+            }
             continue;
         }
         
-        // GET command for first chunk
-        char command[BUFFER_SIZE];
-        sprintf(command, "GET %s %d", filename, chunk_pairs[i][0] + 1);
-        send(server_list->servers[i].socket, command, strlen(command), 0);
-        
-        // get chunk
-        char *chunk_ptr = chunks[chunk_pairs[i][0]];
-        size_t remaining = chunk_size;
-        
-        while (remaining > 0) {
-            int received = recv(server_list->servers[i].socket, chunk_ptr, remaining, 0);
-            if (received <= 0) {
-                break;
+        // erasure coded: any k of the k+m shards; replicated: every chunk; no layout: all four chunks
+        int complete = (held & 0xF) == 0xF;
+        if (layout) {
+            int shards = layout->data_chunks + layout->parity_chunks;
+            unsigned long mask = shards >= 64 ? ~0UL : (1UL << shards) - 1;
+            complete = layout->scheme == LAYOUT_ERASURE ? __builtin_popcountl(held & mask) >= layout->data_chunks
+                                                        : (held & mask) == mask;
+        }
+        printf("%s%s\n", all[i].name, complete ? "" : " [incomplete]");
+        file_count++;
+        for (; i < j; i++) {
+            free(all[i].name);
+        }
+    }
+    free(all);
+    
+    if (file_count == 0) {
+        printf("no files found\n");
+    }
+}
+
+// servers that should hold chunk (or shard) c of a file under server_list, by its layout record
+//or the original placement; how many
+int chunk_targets(ServerList *server_list, const ListedFile *file, const dfs_layout *layout, int chunk, int *targets) {
+    int count = 0;
+    if (layout) {
+        int copies = layout->scheme == LAYOUT_ERASURE ? 1 : layout->replicas;
+        for (int r = 0; r < copies; r++) {
+            targets[count++] = layout_server(layout, server_list, file->name, chunk, r);
+        }
+    } else {
+        int chunk_pairs[4][2];
+        place_chunks(file->name, server_list->count, chunk_pairs);
+        for (int i = 0; i < server_list->count && i < 4; i++) {
+            if (chunk_pairs[i][0] == chunk || chunk_pairs[i][1] == chunk) {
+                targets[count++] = i;
+            }
+        }
+    }
+    return count;
+}
+
+// implementing MOVES command: compare where every stored chunk is now (the listing from the
+//current servers) with where it belongs if the servers were those in config_path, and print
+//each copy that has to be made and each one that becomes surplus
+//servers are matched by their dfc.conf name, so a renamed server counts as a new one
+void show_moves(ServerList *server_list, const char *config_path) {
+    ServerList next;
+    next.count = 0;
+    if (load_config(config_path, &next) < 0 || next.count == 0) {
+        printf("error: no servers in %s\n", config_path);
+        return;
+    }
+    
+    // current server index -> index in the new list, -1 if it goes away
+    int renumber[MAX_SERVERS];
+    for (int i = 0; i < server_list->count; i++) {
+        renumber[i] = -1;
+        for (int j = 0; j < next.count; j++) {
+            if (strcmp(server_list->servers[i].hostname, next.servers[j].hostname) == 0) {
+                renumber[i] = j;
             }
-            chunk_ptr += received;
-            remaining -= received;
+        }
+    }
+    
+    int n;
+    ListedFile *all = gather_listing(server_list, &n);
+    if (!all) {
+        return;
+    }
+    
+    long copies = 0, moved = 0, dropped = 0, unsourced = 0;
+    long moved_bytes = 0;
+    int files = 0;
+    for (int i = 0; i < n; ) {
+        const dfs_layout *layout = NULL;
+        long chunk_size = 0;
+        int j = i;
+        for (; j < n && strcmp(all[j].name, all[i].name) == 0; j++) {
+            if (all[j].has_layout && (!layout || all[j].layout.stamp > layout->stamp)) layout = &all[j].layout;
+            if (all[j].chunk_size > chunk_size) chunk_size = all[j].chunk_size;
         }
         
-        //GET command for second chunk
-        sprintf(command, "GET %s %d", filename, chunk_pairs[i][1] + 1);
-        send(server_list->servers[i].socket, command, strlen(command), 0);
+        // a content chunk has no record of its own: one chunk, placed by its name over all servers
+        //(how many copies it should have depends on the files sharing it, this counts dfc.conf's replicas)
+        dfs_layout content = {LAYOUT_REPLICATED, 1, 0, replica_count, 0, PLACE_RENDEZVOUS, CODEC_NONE, 0, chunk_size, chunk_size};
+        if (!layout && is_content_name(all[i].name)) {
+            layout = &content;
+        }
         
-        // get chunk
-        chunk_ptr = chunks[chunk_pairs[i][1]];
-        remaining = chunk_size;
+        long chunk_len[MAX_CHUNKS];
+        int chunks = 4;
+        if (layout) {
+            chunks = layout->data_chunks + (layout->scheme == LAYOUT_ERASURE ? layout->parity_chunks : 0);
+            layout_chunk_len(layout, chunk_len);
+            for (int c = layout->data_chunks; c < chunks; c++) {
+                chunk_len[c] = layout->chunk_size;
+            }
+        } else {
+            for (int c = 0; c < chunks; c++) {
+                chunk_len[c] = chunk_size;
+            }
+        }
         
-        while (remaining > 0) {
-            int received = recv(server_list->servers[i].socket, chunk_ptr, remaining, 0);
-            if (received <= 0) {
-                break;
+        for (int c = 0; c < chunks && c < MAX_CHUNKS; c++) {
+            // who holds it now, in new list numbering (-1 = leaving)
+            int held_by[MAX_SERVERS];
+            int held = 0;
+            for (int e = i; e < j; e++) {
+                if (listed_chunks(server_list, &all[e]) & (1UL << c)) {
+                    held_by[held++] = all[e].server;
+                }
+            }
+            if (held == 0) {
+                continue;
+            }
+            copies += held;
+            
+            int targets[MAX_SERVERS];
+            int target_count = chunk_targets(&next, &all[i], layout, c, targets);
+            for (int t = 0; t < target_count; t++) {
+                int have = 0;
+                for (int h = 0; h < held; h++) {
+                    have |= renumber[held_by[h]] == targets[t];
+                }
+                if (have) continue;
+                
+                // copy from a holder that stays if there is one
+                int source = held_by[0];
+                for (int h = 0; h < held; h++) {
+                    if (renumber[held_by[h]] >= 0) source = held_by[h];
+                }
+                printf("%s chunk %d: %s -> %s\n", all[i].name, c + 1, server_list->servers[source].hostname,
+                       next.servers[targets[t]].hostname);
+                moved++;
+                moved_bytes += chunk_len[c];
+            }
+            for (int h = 0; h < held; h++) {
+                int keep = 0;
+                for (int t = 0; t < target_count; t++) {
+                    keep |= renumber[held_by[h]] == targets[t];
+                }
+                if (!keep && renumber[held_by[h]] >= 0) {
+                    printf("%s chunk %d: drop from %s\n", all[i].name, c + 1, server_list->servers[held_by[h]].hostname);
+                    dropped++;
+                }
             }
-            chunk_ptr += received;
-            remaining -= received;
+        }
+        files++;
+        for (; i < j; i++) {
+            free(all[i].name);
         }
     }
+    free(all);
     
-    // write chunks to output file
-    FILE *output = fopen(filename, "wb");
-    if (!output) {
-        perror("error creating output file");
-        for (int i = 0; i < 4; i++) {
-            free(chunks[i]);
+    for (int i = 0; i < server_list->count; i++) {
+        if (!server_list->servers[i].connected) {
+            printf("warning: %s is down, its chunks are not counted\n", server_list->servers[i].hostname);
+            unsourced++;
+        }
+    }
+    printf("%d -> %d servers, %d files: %ld of %ld chunk copies move (%.1f%%, %.1f MB), %ld become surplus\n",
+           server_list->count, next.count, files, moved, copies, copies ? 100.0 * moved / copies : 0.0,
+           moved_bytes / 1e6, dropped);
+    if (unsourced) {
+        printf("(bring every server up for an exact answer)\n");
+    }
+}
+
+// redial every server, saying which ones went down or came back since the last time
+void reconnect_servers(ServerList *server_list) {
+    int was[MAX_SERVERS];
+    unsigned all = 0;
+    for (int i = 0; i < server_list->count; i++) {
+        Server *server = &server_list->servers[i];
+        was[i] = server->connected;
+        if (server->connected) {
+            close(server->socket);
+        }
+        all |= 1u << i;
+    }
+    connect_servers(server_list, all, all);
+    for (int i = 0; i < server_list->count; i++) {
+        Server *server = &server_list->servers[i];
+        if (was[i] != server->connected) {
+            printf("server %s %s\n", server->hostname, server->connected ? "is back" : "is down");
+        }
+    }
+}
+
+// implementing REPAIR command: one repair pass, or with an interval one every that many seconds
+//for good (redialing the servers before each, so ones that come back are repaired onto)
+void repair(ServerList *server_list, long interval) {
+    repair_pass(server_list, 0);
+    while (interval > 0) {
+        sleep(interval);
+        reconnect_servers(server_list);
+        repair_pass(server_list, 1);
+    }
+}
+
+// queue a copy on a target's job; -1 if out of memory
+int repair_queue(RepairJob *job, const char *name, int chunk, int source, long bytes) {
+    if (job->count == job->capacity) {
+        int capacity = job->capacity ? job->capacity * 2 : 64;
+        RepairCopy *copies = realloc(job->copies, capacity * sizeof(RepairCopy));
+        if (!copies) {
+            return -1;
         }
+        job->copies = copies;
+        job->capacity = capacity;
+    }
+    RepairCopy *copy = &job->copies[job->count++];
+    copy->name = name;
+    copy->chunk = chunk;
+    copy->source = source;
+    copy->bytes = bytes;
+    return 0;
+}
+
+// wait until a copy of bytes fits under repair_rate, counted from the start of the pass
+//(copies are paced whole, so a big chunk goes at full speed and the ones after it wait longer)
+void repair_pace(long bytes) {
+    if (repair_rate <= 0) {
         return;
     }
-    
-    for (int i = 0; i < 4; i++) {
-        fwrite(chunks[i], 1, chunk_size, output);
+    pthread_mutex_lock(&repair_pacer.lock);
+    long due = repair_pacer.start_us + (long)(repair_pacer.reserved / repair_rate * 1e6);
+    repair_pacer.reserved += bytes;
+    pthread_mutex_unlock(&repair_pacer.lock);
+    long wait = due - now_us();
+    if (wait > 0) {
+        usleep(wait);
     }
-    
-    fclose(output);
-    
-    // free memore
-    for (int i = 0; i < 4; i++) {
-        free(chunks[i]);
+}
+
+// make one target's copies in order: each is a PULL the target server carries out from the source
+//itself. a failed copy skips the rest of that file's copies on this target, its layout record
+//among them, so the target never looks current while holding an old chunk
+void *repair_worker(void *arg) {
+    RepairJob *job = (RepairJob *)arg;
+    Server side = *job->server;
+    side.next_id = 0;
+    side.socket = dial(&side);
+    if (side.socket < 0) {
+        snprintf(job->error, sizeof(job->error), "could not connect");
+        job->failed = job->count;
+        return NULL;
     }
+    struct timeval tv = {REPAIR_TIMEOUT_SEC, 0};
+    setsockopt(side.socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     
-    printf("file %s downloaded successfully\n", filename);
+    const char *skip = NULL;
+    for (int c = 0; c < job->count; c++) {
+        RepairCopy *copy = &job->copies[c];
+        if (copy->name == skip) {
+            job->failed++;
+            continue;
+        }
+        Server *source = &job->server_list->servers[copy->source];
+        struct in_addr address;
+        inet_pton(AF_INET, source->ip, &address);
+        dfs_frame pull;
+        memset(&pull, 0, sizeof(pull));
+        pull.opcode = OP_PULL;
+        pull.chunk = copy->chunk;
+        pull.offset = (uint64_t)ntohl(address.s_addr) << 16 | (uint16_t)source->port;
+        
+        repair_pace(copy->bytes);
+        dfs_frame response;
+        if (send_header(&side, &pull, copy->name, NULL) < 0 || recv_response(&side, &response) < 0) {
+            snprintf(job->error, sizeof(job->error), "%s chunk %d: no answer, giving up on this server",
+                     copy->name, copy->chunk);
+            job->failed += job->count - c;
+            break;
+        }
+        if (response.status == ST_BAD_REQUEST) {
+            // the target only pulls from the servers it was started with -p for
+            snprintf(job->error, sizeof(job->error), "%s chunk %d: server won't pull from %s (not among its -p peers)",
+                     copy->name, copy->chunk, source->hostname);
+            job->failed++;
+            skip = copy->name;
+            continue;
+        }
+        if (response.status != ST_OK) {
+            snprintf(job->error, sizeof(job->error), "%s chunk %d: copy from %s failed (status %d)", copy->name,
+                     copy->chunk, source->hostname, response.status);
+            job->failed++;
+            skip = copy->name;
+            continue;
+        }
+        job->made++;
+        job->bytes_made += copy->bytes;
+    }
+    close(side.socket);
+    return NULL;
 }
 
-// implememting LIST command
-void list_files(ServerList *server_list) {
-    //avoid duplicates, keep track of files already seen
-    char files[100][MAX_FILENAME];
-    int file_count = 0;
+// walk every server's chunk listing, find chunks with fewer copies on their target servers than
+//their layout asks for, and have each target missing one pull it from a server that has it
+//a holder only counts if it has the file's current layout record: one that missed the latest put
+//may hold the previous version's chunks under the same numbers. those that are also targets are
+//preferred, as a non-target may keep chunks of an older layout of the file
+//servers without the current layout record get it (after their chunks), as a put would have given them
+//returns the number of copies that failed or had no source
+int repair_pass(ServerList *server_list, int quiet) {
+    int n;
+    ListedFile *all = gather_listing(server_list, &n);
+    if (!all) {
+        return -1;
+    }
     
-    // get file list from each server
+    RepairJob jobs[MAX_SERVERS];
+    long source_load[MAX_SERVERS] = {0};
     for (int i = 0; i < server_list->count; i++) {
-        if (!server_list->servers[i].connected) {
-            continue;
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].server = &server_list->servers[i];
+        jobs[i].server_list = server_list;
+    }
+    
+    int files = 0, short_files = 0, unsourced = 0, unreachable = 0, queued = 0, failed = 0;
+    for (int i = 0; i < n; ) {
+        const dfs_layout *layout = NULL;
+        long chunk_size = 0;
+        int j = i;
+        for (; j < n && strcmp(all[j].name, all[i].name) == 0; j++) {
+            if (all[j].has_layout && (!layout || all[j].layout.stamp > layout->stamp)) layout = &all[j].layout;
+            if (all[j].chunk_size > chunk_size) chunk_size = all[j].chunk_size;
+        }
+        const dfs_layout *record = layout;
+        dfs_layout content = {LAYOUT_REPLICATED, 1, 0, replica_count, 0, PLACE_RENDEZVOUS, CODEC_NONE, 0, chunk_size, chunk_size};
+        if (!layout && is_content_name(all[i].name)) {
+            layout = &content;
         }
         
-        // send LIST cmd
-        char command[] = "LIST";
-        send(server_list->servers[i].socket, command, strlen(command), 0);
+        // which listing entries are of the current version
+        int current[MAX_SERVERS];
+        for (int e = i; e < j; e++) {
+            current[e - i] = !record || (all[e].has_layout && all[e].layout.stamp == record->stamp);
+        }
+        
+        long chunk_len[MAX_CHUNKS];
+        int chunks = 4;
+        if (layout) {
+            chunks = layout->data_chunks + (layout->scheme == LAYOUT_ERASURE ? layout->parity_chunks : 0);
+            layout_chunk_len(layout, chunk_len);
+            for (int c = layout->data_chunks; c < chunks && c < MAX_CHUNKS; c++) {
+                chunk_len[c] = layout->chunk_size;
+            }
+        } else {
+            for (int c = 0; c < chunks; c++) {
+                chunk_len[c] = chunk_size;
+            }
+        }
         
-        // get response
-        char buffer[BUFFER_SIZE];
-        int received = recv(server_list->servers[i].socket, buffer, BUFFER_SIZE, 0);
-        if (received > 0) {
-            buffer[received] = '\0';
+        int was_queued = queued;
+        for (int c = 0; c < chunks && c < MAX_CHUNKS; c++) {
+            int targets[MAX_SERVERS];
+            int target_count = chunk_targets(server_list, &all[i], layout, c, targets);
+            int held_by[MAX_SERVERS];
+            int held = 0, on_target = 0;
+            for (int e = i; e < j; e++) {
+                if (!current[e - i] || !(listed_chunks(server_list, &all[e]) & (1UL << c))) {
+                    continue;
+                }
+                int is_target = 0;
+                for (int t = 0; t < target_count; t++) {
+                    is_target |= targets[t] == all[e].server;
+                }
+                if (is_target && !on_target) {
+                    held = 0;  // targets only from here on
+                }
+                if (is_target || !on_target) {
+                    held_by[held++] = all[e].server;
+                }
+                on_target |= is_target;
+            }
             
-            char *line = strtok(buffer, "\n");
-            while (line) {
-                // check if file already in list
-                int found = 0;
-                for (int j = 0; j < file_count; j++) {
-                    if (strcmp(files[j], line) == 0) {
-                        found = 1;
-                        break;
-                    }
+            for (int t = 0; t < target_count; t++) {
+                int have = 0;
+                for (int e = i; e < j; e++) {
+                    have |= all[e].server == targets[t] && current[e - i] &&
+                            (listed_chunks(server_list, &all[e]) >> c & 1);
                 }
-                
-                if (!found && file_count < 100) {
-                    strncpy(files[file_count], line, MAX_FILENAME - 1);
-                    files[file_count][MAX_FILENAME - 1] = '\0';
-                    file_count++;
+                if (have) continue;
+                Server *target = &server_list->servers[targets[t]];
+                if (!target->connected || !target->binary) {
+                    unreachable++;
+                    continue;
                 }
                 
-                line = strtok(NULL, "\n");
+                // the least loaded holder that can serve a binary GET
+                int source = -1;
+                for (int h = 0; h < held; h++) {
+                    Server *holder = &server_list->servers[held_by[h]];
+                    if (holder->connected && holder->binary &&
+                        (source < 0 || source_load[held_by[h]] < source_load[source])) {
+                        source = held_by[h];
+                    }
+                }
+                if (source < 0) {
+                    printf("%s chunk %d: no intact copy to restore %s's from%s\n", all[i].name, c + 1,
+                           target->hostname, layout && layout->scheme == LAYOUT_ERASURE
+                               ? " (an erasure shard is rebuilt by getting and putting the file again)" : "");
+                    unsourced++;
+                    continue;
+                }
+                if (repair_queue(&jobs[targets[t]], all[i].name, c + 1, source, chunk_len[c]) < 0) {
+                    perror("memory allocation failed");
+                    unsourced++;
+                    continue;
+                }
+                source_load[source] += chunk_len[c];
+                queued++;
+            }
+        }
+        
+        // the layout record to every server lacking the current one, from one that has it
+        for (int s = 0; record && s < server_list->count; s++) {
+            int have = 0, source = -1;
+            for (int e = i; e < j; e++) {
+                have |= all[e].server == s && current[e - i];
+                if (current[e - i] && server_list->servers[all[e].server].binary) source = all[e].server;
+            }
+            if (!have && source >= 0 && server_list->servers[s].connected && server_list->servers[s].binary &&
+                repair_queue(&jobs[s], all[i].name, DFS_LAYOUT_CHUNK, source, DFS_LAYOUT_SIZE) == 0) {
+                queued++;
             }
         }
+        short_files += queued > was_queued;
+        files++;
+        i = j;
     }
     
-    // display files
-    for (int i = 0; i < file_count; i++) {
-        if (check_file_completeness(server_list, files[i])) {
-            printf("%s\n", files[i]);
-        } else {
-            printf("%s [incomplete]\n", files[i]);
+    // a thread per target server, copies on each one after the other
+    pthread_t threads[MAX_SERVERS];
+    repair_pacer.start_us = now_us();
+    repair_pacer.reserved = 0;
+    long start = now_us();
+    for (int i = 0; i < server_list->count; i++) {
+        threads[i] = 0;
+        if (jobs[i].count > 0 && pthread_create(&threads[i], NULL, repair_worker, &jobs[i]) != 0) {
+            threads[i] = 0;
+            jobs[i].failed = jobs[i].count;
+            snprintf(jobs[i].error, sizeof(jobs[i].error), "could not start thread");
         }
     }
+    long bytes = 0;
+    for (int i = 0; i < server_list->count; i++) {
+        if (threads[i]) pthread_join(threads[i], NULL);
+        if (jobs[i].count > 0) {
+            double seconds = (now_us() - start) / 1e6;
+            printf("server %s: %d of %d copies made (%ld bytes, %.1f MB/s)%s%s\n", server_list->servers[i].hostname,
+                   jobs[i].made, jobs[i].count, jobs[i].bytes_made, seconds > 0 ? jobs[i].bytes_made / seconds / 1e6 : 0.0,
+                   jobs[i].failed ? " - " : "", jobs[i].failed ? jobs[i].error : "");
+        }
+        bytes += jobs[i].bytes_made;
+        failed += jobs[i].failed;
+        free(jobs[i].copies);
+    }
+    for (int i = 0; i < n; i++) {
+        free(all[i].name);
+    }
+    free(all);
     
-    if (file_count == 0) {
-        printf("no files found\n");
+    if (!quiet || queued > 0 || unsourced > 0) {
+        printf("repair: %d files, %d short of copies: %d of %d copies made (%.1f MB)", files, short_files,
+               queued - failed, queued, bytes / 1e6);
+        if (unsourced) printf(", %d without a source", unsourced);
+        if (unreachable) printf(", %d waiting for their server", unreachable);
+        printf("\n");
     }
-}
\ No newline at end of file
+    if (!quiet && unreachable) {
+        printf("(a server that is gone for good comes out of dfc.conf, and its chunks are re-placed on the rest)\n");
+    }
+    return failed + unsourced;
+}
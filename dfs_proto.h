@@ -0,0 +1,196 @@
+// binary wire protocol shared by dfc and dfs
+//every message is a fixed 40 byte header, then name_len bytes of filename, then length bytes of payload
+//requests carry a request_id that the response echoes, so many can be in flight on one
+//connection and responses may come back in any order
+//a connection whose first 4 bytes are not DFS_MAGIC speaks the old newline text protocol
+#ifndef DFS_PROTO_H
+#define DFS_PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define DFS_MAGIC "DFSB"
+#define DFS_VERSION 1
+#define DFS_HEADER_SIZE 40
+
+// opcodes, responses use the same opcode with DFS_RESPONSE set
+enum {
+    OP_HELLO = 1,   // version check, no payload
+    OP_PUT,         // store chunk `chunk` of name, payload = chunk data
+    OP_GET,         // fetch chunk `chunk` of name, response payload = chunk data
+    OP_CHECK,       // does this server hold any chunk of name
+    OP_SIZE,        // size of a chunk of name, response `offset` = size
+    OP_LIST,        // response payload = '\n' separated names
+    OP_LIST_CHUNKS, // response payload = chunk records (below), split over DFS_FLAG_MORE frames
+    OP_PULL,        // copy chunk `chunk` of name from the server at `offset` (IPv4 address << 16 | port)
+                    //and store it here, response checksum = CRC of what was stored
+    OP_READ         // bytes from `offset` of chunk `chunk` of name, request payload = u64 byte count;
+                    //response payload = those bytes (fewer past the end of the chunk), checksum = CRC of them
+};
+#define DFS_RESPONSE 0x80
+
+// response status
+enum {
+    ST_OK = 0,
+    ST_NOT_FOUND,
+    ST_ERROR,
+    ST_BAD_REQUEST
+};
+
+// flags
+#define DFS_FLAG_CHECKSUM 0x0001  // checksum holds a CRC of the payload
+#define DFS_FLAG_MORE     0x0002  // response continues in another frame with the same request id
+
+// OP_LIST_CHUNKS record, one per file:
+//u16 name_len, name, u16 chunk_count, chunk_count x (u32 chunk, u64 size), u16 layout_len, layout
+#define DFS_RECORD_CHUNK_SIZE 12
+
+// chunk 0 of a file, when present, is its layout record rather than data
+//(files without one are the original 4 chunk, 2 replica layout)
+#define DFS_LAYOUT_CHUNK 0
+#define DFS_LAYOUT_MAGIC "DFSL"
+#define DFS_LAYOUT_SIZE 32
+#define DFS_MAX_SERVERS 10  // most servers a layout's replicas or stripe can name
+
+enum {
+    LAYOUT_REPLICATED = 1,  // data_chunks chunks, each on `replicas` consecutive servers of the stripe
+    LAYOUT_ERASURE,         // data_chunks + parity_chunks Reed-Solomon shards
+    LAYOUT_DEDUP            // content defined chunks stored under their hash, chunk 1 is the recipe (below)
+};
+
+// recipe of a deduplicated file, chunk_size bytes, on `replicas` servers of the stripe:
+//magic, u32 count, count x (sha-256, u64 length) in file order, u32 crc32c of everything before it
+//each chunk is chunk 1 of the name '@' + hex sha-256 of its bytes, on its own `replicas` servers
+//picked by rendezvous over all servers, so a chunk shared by files (or versions) is stored once
+#define DFS_RECIPE_MAGIC "DFSM"
+#define DFS_RECIPE_ENTRY 40
+
+// how chunk data is encoded, the same for every chunk of a file (dfs stores and checks it as is)
+enum {
+    CODEC_NONE = 0,
+    CODEC_LZ4               // chunk is a run of blocks (below), each of DFS_BLOCK_SIZE raw bytes or less
+};
+
+// compressed chunk block: u32 raw length, u32 stored length (DFS_BLOCK_RAW set = stored as is), data
+//blocks are independent so a reader decodes them as they arrive
+#define DFS_BLOCK_SIZE 65536
+#define DFS_BLOCK_HEADER 8
+#define DFS_BLOCK_RAW 0x80000000u
+
+// how chunks map to servers
+enum {
+    PLACE_RING = 0,         // stripe server i is (hash + i) % server count, moves on any membership change
+    PLACE_RENDEZVOUS        // highest random weight over server names, see dfc's rendezvous_server
+};
+
+typedef struct {
+    uint8_t scheme;
+    uint8_t data_chunks;
+    uint8_t parity_chunks;
+    uint8_t replicas;
+    uint8_t width;          // servers the chunks are spread over
+    uint8_t placement;
+    uint8_t codec;
+    uint32_t stamp;         // put time (unix seconds), the newest record of a file wins
+    uint64_t file_size;
+    uint64_t chunk_size;
+} dfs_layout;
+
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t request_id;
+    uint16_t status;
+    uint16_t name_len;
+    uint32_t chunk;
+    uint32_t checksum;
+    uint64_t offset;
+    uint64_t length;     // payload bytes after the name
+} dfs_frame;
+
+// big endian field access
+static inline void dfs_put16(unsigned char *p, uint16_t v) { v = htobe16(v); memcpy(p, &v, 2); }
+static inline void dfs_put32(unsigned char *p, uint32_t v) { v = htobe32(v); memcpy(p, &v, 4); }
+static inline void dfs_put64(unsigned char *p, uint64_t v) { v = htobe64(v); memcpy(p, &v, 8); }
+static inline uint16_t dfs_get16(const unsigned char *p) { uint16_t v; memcpy(&v, p, 2); return be16toh(v); }
+static inline uint32_t dfs_get32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return be32toh(v); }
+static inline uint64_t dfs_get64(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return be64toh(v); }
+
+// header to wire format
+static inline void dfs_encode(const dfs_frame *f, unsigned char out[DFS_HEADER_SIZE]) {
+    memcpy(out, DFS_MAGIC, 4);
+    out[4] = f->version;
+    out[5] = f->opcode;
+    dfs_put16(out + 6, f->flags);
+    dfs_put32(out + 8, f->request_id);
+    dfs_put16(out + 12, f->status);
+    dfs_put16(out + 14, f->name_len);
+    dfs_put32(out + 16, f->chunk);
+    dfs_put32(out + 20, f->checksum);
+    dfs_put64(out + 24, f->offset);
+    dfs_put64(out + 32, f->length);
+}
+
+// wire format to header, -1 if the magic or version is wrong
+static inline int dfs_decode(const unsigned char in[DFS_HEADER_SIZE], dfs_frame *f) {
+    if (memcmp(in, DFS_MAGIC, 4) != 0 || in[4] != DFS_VERSION) {
+        return -1;
+    }
+    f->version = in[4];
+    f->opcode = in[5];
+    f->flags = dfs_get16(in + 6);
+    f->request_id = dfs_get32(in + 8);
+    f->status = dfs_get16(in + 12);
+    f->name_len = dfs_get16(in + 14);
+    f->chunk = dfs_get32(in + 16);
+    f->checksum = dfs_get32(in + 20);
+    f->offset = dfs_get64(in + 24);
+    f->length = dfs_get64(in + 32);
+    return 0;
+}
+
+// layout record: magic, version, scheme, data, parity, replicas, width, placement, codec, stamp, file size, chunk size
+static inline void dfs_encode_layout(const dfs_layout *l, unsigned char out[DFS_LAYOUT_SIZE]) {
+    memset(out, 0, DFS_LAYOUT_SIZE);
+    memcpy(out, DFS_LAYOUT_MAGIC, 4);
+    out[4] = 1;
+    out[5] = l->scheme;
+    out[6] = l->data_chunks;
+    out[7] = l->parity_chunks;
+    out[8] = l->replicas;
+    out[9] = l->width;
+    out[10] = l->placement;
+    out[11] = l->codec;
+    dfs_put32(out + 12, l->stamp);
+    dfs_put64(out + 16, l->file_size);
+    dfs_put64(out + 24, l->chunk_size);
+}
+
+// wire format to layout record, -1 if it isn't one or holds values no writer produces
+//(readers size per-replica arrays by DFS_MAX_SERVERS and divide by chunk_size)
+static inline int dfs_decode_layout(const unsigned char *in, long len, dfs_layout *l) {
+    if (len < DFS_LAYOUT_SIZE || memcmp(in, DFS_LAYOUT_MAGIC, 4) != 0 || in[4] != 1) {
+        return -1;
+    }
+    l->scheme = in[5];
+    l->data_chunks = in[6];
+    l->parity_chunks = in[7];
+    l->replicas = in[8];
+    l->width = in[9];
+    l->placement = in[10];
+    l->codec = in[11];
+    l->stamp = dfs_get32(in + 12);
+    l->file_size = dfs_get64(in + 16);
+    l->chunk_size = dfs_get64(in + 24);
+    if (l->scheme < LAYOUT_REPLICATED || l->scheme > LAYOUT_DEDUP ||
+        l->replicas == 0 || l->replicas > DFS_MAX_SERVERS || l->width > DFS_MAX_SERVERS ||
+        l->placement > PLACE_RENDEZVOUS || l->codec > CODEC_LZ4 ||
+        (l->chunk_size == 0 && l->file_size > 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,153 @@
+#include <string.h>
+#include "lz.h"
+
+// a block is a run of sequences: token (literal count << 4 | match length - 4, 15 = more in the
+//bytes that follow, each adding up to 255), literals, 2 byte little endian offset back, match
+//length bytes. the last sequence is literals only, and starts at least 5 bytes before the end
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12      // no match starts in the last 12 bytes
+#define MAX_OFFSET 65535
+#define HASH_BITS 14
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// a length past 15 in the token: 255s, then the remainder
+static uint8_t *put_length(uint8_t *op, int len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+    uint32_t table[1 << HASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    const uint8_t *mf_limit = end - MF_LIMIT, *match_limit = end - LAST_LITERALS;
+    uint8_t *op = dst, *op_end = dst + cap;
+    memset(table, 0, sizeof(table));
+    
+    // no match is looked for at position 0, so a table slot of 0 means empty
+    if (len > MF_LIMIT) {
+        ip++;
+        int misses = 0;
+        while (ip < mf_limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = ip - src;
+            if (ref == src || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                // step up through data that doesn't match (it likely won't start to)
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *match_end = ip + MIN_MATCH;
+            const uint8_t *ref_end = ref + MIN_MATCH;
+            while (match_end < match_limit && *match_end == *ref_end) {
+                match_end++;
+                ref_end++;
+            }
+            
+            int literals = ip - anchor;
+            int match = match_end - ip - MIN_MATCH;
+            if (op_end - op < 1 + literals + literals / 255 + 1 + 2 + match / 255 + 1) {
+                return 0;
+            }
+            uint8_t *token = op++;
+            *token = (literals < 15 ? literals : 15) << 4;
+            if (literals >= 15) op = put_length(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+            op[0] = (ip - ref) & 0xff;
+            op[1] = (ip - ref) >> 8;
+            op += 2;
+            *token |= match < 15 ? match : 15;
+            if (match >= 15) op = put_length(op, match - 15);
+            
+            ip = anchor = match_end;
+            if (ip < mf_limit) {
+                table[hash4(read32(ip - 2))] = ip - 2 - src;
+            }
+        }
+    }
+    
+    int literals = end - anchor;
+    if (op_end - op < 1 + literals + literals / 255 + 1) {
+        return 0;
+    }
+    *op++ = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15) op = put_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+    const uint8_t *ip = src, *ip_end = src + len;
+    uint8_t *op = dst, *op_end = dst + cap;
+    while (ip < ip_end) {
+        int token = *ip++;
+        long literals = token >> 4;
+        if (literals == 15) {
+            int b;
+            do {
+                if (ip >= ip_end) return -1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > ip_end - ip || literals > op_end - op) {
+            return -1;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == ip_end) {
+            break;  // last sequence, literals only
+        }
+        
+        if (ip_end - ip < 2) {
+            return -1;
+        }
+        long offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        long match = token & 15;
+        if (match == 15) {
+            int b;
+            do {
+                if (ip >= ip_end) return -1;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        match += MIN_MATCH;
+        if (offset == 0 || offset > op - dst || match > op_end - op) {
+            return -1;
+        }
+        
+        // a match closer than its length repeats itself, so it is copied forward a byte at a time
+        const uint8_t *ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            while (match-- > 0) *op++ = *ref++;
+        }
+    }
+    return op - dst;
+}
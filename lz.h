@@ -0,0 +1,19 @@
+// LZ4 block format, the codec of dfc's compressed chunks: greedy single-probe matching, 64K window
+//fast enough both ways that compressing logs and CSV costs less than sending them raw
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// largest compressed size of len bytes (incompressible data grows by a byte per 255 + a few)
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+// compress len bytes of src into dst (room for cap bytes); compressed size, 0 if it didn't fit
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+// decompress len bytes of src into dst (room for cap bytes); decompressed size, -1 if src is
+//malformed or would overrun dst
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+#endif
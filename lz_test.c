@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "lz.h"
+
+// LZ block codec checks: round trips of random, repetitive and incompressible blocks of every size
+//class, then truncated and corrupted blocks, which must be refused (or come out short) without
+//writing past the output; throughput of the round trips on the side
+//usage: lz_test [block KB] [rounds]
+
+#define GUARD 64  // bytes past the output that must stay untouched
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// len bytes of one kind: words over a small alphabet, a short phrase over and over, or noise
+void fill(uint8_t *buf, int len, int kind) {
+    static const char *words[] = {"get", "put", "chunk", "server", "replica", "layout", "OK", "DATA"};
+    const char *phrase = "2026-10-19 10:42:07 dfs1 PUT /data/part-0001 200 ";
+    int plen = strlen(phrase);
+    for (int i = 0; i < len; ) {
+        if (kind == 0) {
+            const char *w = words[rand() % 8];
+            for (int j = 0; w[j] && i < len; j++) buf[i++] = w[j];
+            if (i < len) buf[i++] = rand() % 4 ? ' ' : '\n';
+        } else if (kind == 1) {
+            buf[i] = phrase[i % plen];
+            i++;
+        } else {
+            buf[i++] = rand();
+        }
+    }
+}
+
+// decode into exactly cap bytes of room followed by a guard; what lz_decompress returned, or
+//-2 if it wrote past cap
+int decode_guarded(const uint8_t *src, int len, uint8_t *out, int cap) {
+    memset(out + cap, 0xa5, GUARD);
+    int got = lz_decompress(src, len, out, cap);
+    for (int i = 0; i < GUARD; i++) {
+        if (out[cap + i] != 0xa5) return -2;
+    }
+    return got;
+}
+
+int main(int argc, char *argv[]) {
+    int block = (argc > 1 ? atoi(argv[1]) : 64) * 1024;
+    int rounds = argc > 2 ? atoi(argv[2]) : 50;
+    if (block <= 0 || rounds < 1) {
+        printf("usage: %s [block KB] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    uint8_t *raw = malloc(block);
+    uint8_t *packed = malloc(LZ_BOUND(block));
+    uint8_t *bad = malloc(LZ_BOUND(block));
+    uint8_t *out = malloc(block + GUARD);
+    if (!raw || !packed || !bad || !out) {
+        perror("memory allocation failed");
+        return 1;
+    }
+    srand(1);
+
+    const char *kinds[] = {"random", "repeat", "noise"};
+    int sizes[] = {0, 1, 4, 12, 13, 15, 16, 100, 255, 270, 4096, 65535, block};
+    int size_count = sizeof(sizes) / sizeof(sizes[0]);
+    printf("%d KB blocks, %d rounds\n\n", block / 1024, rounds);
+    printf("  %-8s %8s %12s %12s\n", "input", "ratio", "pack MB/s", "unpack MB/s");
+
+    for (int kind = 0; kind < 3; kind++) {
+        // round trips, every size
+        for (int s = 0; s < size_count; s++) {
+            int len = sizes[s] < block ? sizes[s] : block;
+            fill(raw, len, kind);
+            int stored = lz_compress(raw, len, packed, LZ_BOUND(len));
+            if (stored <= 0 || stored > LZ_BOUND(len)) {
+                printf("error: %s block of %d bytes didn't compress within LZ_BOUND (%d)\n", kinds[kind], len, stored);
+                return 1;
+            }
+            if (decode_guarded(packed, stored, out, len) != len || memcmp(out, raw, len) != 0) {
+                printf("error: %s block of %d bytes came back wrong\n", kinds[kind], len);
+                return 1;
+            }
+            if (len > 0 && decode_guarded(packed, stored, out, len - 1) != -1) {
+                printf("error: %s block of %d bytes decoded into %d bytes of room\n", kinds[kind], len, len - 1);
+                return 1;
+            }
+            if (len > 16 && kind == 2 && lz_compress(raw, len, packed, len - 1) != 0) {
+                printf("error: noise of %d bytes claims to fit in %d\n", len, len - 1);
+                return 1;
+            }
+        }
+
+        // a full block, timed
+        fill(raw, block, kind);
+        int stored = 0;
+        double start = now_sec();
+        for (int r = 0; r < rounds; r++) stored = lz_compress(raw, block, packed, LZ_BOUND(block));
+        double pack = now_sec() - start;
+        start = now_sec();
+        int got = 0;
+        for (int r = 0; r < rounds; r++) got = lz_decompress(packed, stored, out, block);
+        double unpack = now_sec() - start;
+        if (got != block || memcmp(out, raw, block) != 0) {
+            printf("error: %s full block came back wrong\n", kinds[kind]);
+            return 1;
+        }
+
+        // every truncation refused or short, random corruption never past the output
+        for (int cut = 0; cut < stored; cut += 1 + cut / 64) {
+            got = decode_guarded(packed, cut, out, block);
+            if (got == -2 || got >= block) {
+                printf("error: %s block cut to %d of %d bytes decoded to %d\n", kinds[kind], cut, stored, got);
+                return 1;
+            }
+        }
+        for (int trial = 0; trial < 2000; trial++) {
+            memcpy(bad, packed, stored);
+            for (int flips = 1 + rand() % 4; flips > 0; flips--) {
+                bad[rand() % stored] ^= 1 + rand() % 255;
+            }
+            int len = trial % 2 ? stored : 1 + rand() % stored;
+            if (decode_guarded(bad, len, out, block) == -2) {
+                printf("error: corrupted %s block wrote past the output\n", kinds[kind]);
+                return 1;
+            }
+        }
+
+        double mb = (double)block * rounds / 1e6;
+        printf("  %-8s %7.1f%% %12.0f %12.0f\n", kinds[kind], 100.0 * stored / block, mb / pack, mb / unpack);
+    }
+
+    printf("\nall checks passed\n");
+    free(raw);
+    free(packed);
+    free(bad);
+    free(out);
+    return 0;
+}
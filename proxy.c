@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> //strncasecmp
 #include <unistd.h>  // unix lib for close
 #include <netdb.h>   //for gethostbyname
 #include <signal.h>
@@ -15,38 +16,264 @@
 #include <errno.h>
 #include <fcntl.h> //file operationss
 #include <ctype.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/select.h> //pselect
+#include <sys/time.h>
+#include "proxy_trace.h"
 
 #define MAX_REQUEST_SIZE 8192  // max size for http req
 #define MAX_URL_SIZE 2048  // max url
 #define MAX_PATH_SIZE 2048
 #define MAX_CACHE_PATH 256      // max size for cache filepath
+#define MAX_HEADER_SIZE 8192    // origin reply headers we can parse
+#define LENGTH_DIGITS 20        // width reserved for the cached Content-Length
 #define BUFFER_SIZE 8192
+#define ARENA_SIZE (32 * 1024)  // per-connection scratch space (request, url, host, path...)
+#define POOL_MAX_FREE 256       // blocks kept on a free list before going back to the heap
+#define MAX_PEERS 8             // sibling proxies
+#define PEER_WAIT_MS 100        // default wait for sibling replies
+#define RELAY_HIGH_WATER (256 * 1024)  // default: stop reading origin with this much unsent
+#define RELAY_LOW_WATER (64 * 1024)    // default: resume reading once drained to this
+#define RELAY_IDLE_MS 30000     // give up on a relay with no progress for this long
+#define TRACE_RINGS 64          // rings handler threads can claim while tracing
+#define TRACE_RING_SIZE 256     // records per ring, power of two
+#define TRACE_FLUSH_MS 200      // how often the flusher drains the rings
 
 //global vars
 int server_fd;    //server socket global var
+volatile sig_atomic_t stop_requested = 0;  // set by SIGINT, main and the flusher wind down on it
 int timeout_seconds; //timeout duration var
 
+// bump allocator, reset by dropping the whole block
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+} arena_t;
+
+// per-connection state; arena space follows it in the same pooled block
+typedef struct {
+    int client_sock;
+    arena_t arena;
+    uint64_t start_mono_us;   // accept time for phase stamps
+    trace_record trace;
+} conn_ctx;
+
+// pooled i/o buffer, chained into a relay ring
+typedef struct io_buf {
+    struct io_buf *next;
+    int len;
+    char data[BUFFER_SIZE];
+} io_buf;
+
+// bytes flowing origin -> client: a ring of pooled io buffers
+// head..tail hold unsent data, sent buffers go straight back to the pool
+typedef struct {
+    io_buf *head;
+    io_buf *tail;
+    io_buf *send_buf;   // next byte for the client is send_buf->data[send_off]
+    int send_off;
+    long queued_bytes;  // pushed for the client
+    long sent_bytes;    // to client
+    int client_gone;    // stop queueing once the client left
+    long limit;         // fill-through: most unsent bytes queued for the client, 0 = no limit
+    int spilled;        // went over it: body bytes from resume_at on are read back from the cache file
+    long resume_at;
+} relay_state;
+
+// incremental parse of the origin reply
+enum { RD_HEADER, RD_BODY, RD_CHUNK_SIZE, RD_CHUNK_DATA, RD_CHUNK_END, RD_TRAILER, RD_DONE, RD_BAD };
+
+typedef struct {
+    int state;
+    char *hdr;            // header bytes so far (arena, MAX_HEADER_SIZE)
+    int hdr_len;
+    int chunked;
+    long remaining;       // left in the current chunk or body, -1 = until close
+    char line[64];        // chunk size / trailer line
+    int line_len;
+    long body_bytes;      // de-chunked body bytes seen
+    int headers_done;     // header block parsed (and relayed, for a decoded client)
+} http_reader;
+
+// cache entry being written while the reply streams through
+typedef struct {
+    int fd;               // temp file, -1 when not caching
+    char key[33];
+    char part_path[MAX_CACHE_PATH];
+    char final_path[MAX_CACHE_PATH];
+    off_t length_at;      // offset of the reserved Content-Length digits
+    off_t body_at;        // where the body starts
+} cache_fill;
+
+// free list of fixed size blocks shared by all threads
+typedef struct pool_node {
+    struct pool_node *next;
+} pool_node;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pool_node *free_list;
+    size_t block_size;
+    int free_count;
+} block_pool;
+
+block_pool conn_pool = {PTHREAD_MUTEX_INITIALIZER, NULL, sizeof(conn_ctx) + ARENA_SIZE, 0};
+block_pool io_pool = {PTHREAD_MUTEX_INITIALIZER, NULL, sizeof(io_buf), 0};
+
+// another proxy we can fetch cached objects from
+typedef struct {
+    char name[64];
+    struct sockaddr_in http_addr;  // proxy port
+    struct sockaddr_in udp_addr;   // icp query port
+} peer_t;
+
+peer_t siblings[MAX_PEERS];
+int sibling_count = 0;
+peer_t parent;
+int has_parent = 0;
+int peer_wait_ms = PEER_WAIT_MS;
+long relay_high_water = RELAY_HIGH_WATER;
+long relay_low_water = RELAY_LOW_WATER;
+int fill_through = 0;  // -F: keep filling the cache at origin speed
+atomic_uint icp_next_id;
+
+// single producer (the handler thread that claimed it), single consumer (the flusher)
+typedef struct {
+    atomic_int in_use;
+    atomic_uint head;
+    atomic_uint tail;
+    trace_record records[TRACE_RING_SIZE];
+} trace_ring;
+
+trace_ring *trace_rings = NULL;  // only allocated with -t
+FILE *trace_file = NULL;
+atomic_long trace_dropped;
+
+// allocator counters, served at /proxy-stats
+struct {
+    atomic_long heap_allocs;     // blocks that had to come from malloc
+    atomic_long heap_frees;      // blocks returned to the heap (free list full)
+    atomic_long pool_reuses;     // blocks served from a free list
+    atomic_long arena_bytes;     // bytes handed out by connection arenas
+    atomic_long arena_exhausted; // arena requests that did not fit
+} alloc_stats;
+
 //all functions:
-void *handleClient(void *client_sock_ptr);
+void *handleClient(void *conn_ptr);
 void parseReq(char *request, char *method, char *url, char *host, int *port, char *path);
 int is_valid_request(char *method);
-char *hashFunction(const char *url);
+void hashFunction(const char *url, char *cache_key);
 int checkCache(const char *cache_key, time_t current_time);
-void cacheResponse(const char *cache_key, const char *response, int response_size);
 void cleanup(int signal);
+int serve_cached(conn_ctx *conn, const char *cache_key);
+long relay_response(conn_ctx *conn, struct sockaddr_in *addr, const char *out_request, const char *cache_key, int client_http11);
+int relay_push(relay_state *relay, const char *data, int len);
+long relay_drain(relay_state *relay, int client_sock);
+int copy_headers(const char *src, int src_len, char *dst, int dst_cap, int drop_length);
+void cache_begin(cache_fill *fill, const char *cache_key, const char *hdr, int hdr_len);
+void cache_finish(cache_fill *fill, long body_len, int complete);
+void reader_headers_done(http_reader *rd);
+void reader_feed(http_reader *rd, const char *data, int len, relay_state *relay, int decoded_client, cache_fill *fill);
+int relay_catch_up(relay_state *relay, int fd, off_t body_at, long body_len);
+int parse_peer(const char *spec, peer_t *peer);
+int query_siblings(const char *cache_key);
+void *icp_responder(void *arg);
+int is_cache_key(const char *key);
+void trace_mark(conn_ctx *conn, int phase);
+void trace_commit(conn_ctx *conn);
+void trace_flush(void);
+void *trace_flusher(void *arg);
+void finish_conn(conn_ctx *conn);
 
 // signal handler for exit
+//only flags it: main notices in its accept wait and shuts down from there
 void cleanup(int signal) {
-     printf("\nclosing proxy server\n");
-    close(server_fd);  //close socket
-exit(0);
+    (void)signal;
+    stop_requested = 1;
+}
+
+
+// take a block from the pool, fall back to the heap when empty
+void *pool_get(block_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool_node *node = pool->free_list;
+    if (node != NULL) {
+        pool->free_list = node->next;
+        pool->free_count--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (node != NULL) {
+        atomic_fetch_add(&alloc_stats.pool_reuses, 1);
+        return node;
+    }
+    atomic_fetch_add(&alloc_stats.heap_allocs, 1);
+    return malloc(pool->block_size);
+}
+
+// give a block back, keep at most POOL_MAX_FREE around
+void pool_put(block_pool *pool, void *block) {
+    if (block == NULL) return;
+    pool_node *node = block;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count < POOL_MAX_FREE) {
+        node->next = pool->free_list;
+        pool->free_list = node;
+        pool->free_count++;
+        node = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (node != NULL) {
+        atomic_fetch_add(&alloc_stats.heap_frees, 1);
+        free(node);
+    }
+}
+
+// carve n bytes (16 aligned) out of the arena, NULL when full
+void *arena_alloc(arena_t *arena, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    if (arena->used + n > arena->size) {
+        atomic_fetch_add(&alloc_stats.arena_exhausted, 1);
+        return NULL;
+    }
+    void *ptr = arena->base + arena->used;
+    arena->used += n;
+    atomic_fetch_add(&alloc_stats.arena_bytes, n);
+    return ptr;
 }
 
+// return a chain of io buffers to the pool
+void release_chain(io_buf *chain) {
+    while (chain != NULL) {
+        io_buf *next = chain->next;
+        pool_put(&io_pool, chain);
+        chain = next;
+    }
+}
 
-// generate hash key
-char *hashFunction(const char *url) {
+// write allocator counters as a plain text http response
+void send_stats(int client_sock) {
+    char body[512];
+    char response[768];
+    int body_len = snprintf(body, sizeof(body),
+        "heap_allocs %ld\nheap_frees %ld\npool_reuses %ld\n"
+        "arena_bytes %ld\narena_exhausted %ld\n",
+        atomic_load(&alloc_stats.heap_allocs), atomic_load(&alloc_stats.heap_frees),
+        atomic_load(&alloc_stats.pool_reuses), atomic_load(&alloc_stats.arena_bytes),
+        atomic_load(&alloc_stats.arena_exhausted));
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s",
+        body_len, body);
+    send(client_sock, response, len, 0);
+}
+
+// generate hash key into cache_key (33 bytes)
+void hashFunction(const char *url, char *cache_key) {
     unsigned char digest[MD5_DIGEST_LENGTH];  //create array to put cache  key
-    char *cache_key = malloc(33);  //allocate mem for key (32+1)
 
     MD5((unsigned char*)url, strlen(url), digest);  // generate hash for url
 
@@ -54,8 +281,6 @@ char *hashFunction(const char *url) {
     for (int i = 0; i < MD5_DIGEST_LENGTH; i++) {
         sprintf(&cache_key[i*2], "%02x", (unsigned int)digest[i]);
     }
-
-    return cache_key;
 }
 
 // check if valid response exists + not expires
@@ -77,25 +302,6 @@ char cache_path[MAX_CACHE_PATH];  // path to cach fille
     return 0;  // cache miss
 }
 
-// store response in cache
-void cacheResponse(const char *cache_key, const char *response, int response_size) {
-    char cache_path[MAX_CACHE_PATH];
-    FILE *cache_file;
-    mkdir("./cache", 0777);  //create dir ide
-sprintf(cache_path, "./cache/%s", cache_key);
-
-    //open file
-    cache_file = fopen(cache_path, "wb");
-    if (cache_file == NULL) {
-        perror("failed to open file");
-        return;
-    }
-
-//write response to cachefile
-    fwrite(response, 1, response_size, cache_file);
-    fclose(cache_file);
-}
-
 // check if http method is GET
 int is_valid_request(char *method) {
     return strcmp(method, "GET") == 0;
@@ -171,161 +377,950 @@ int is_dynamic_content(const char *url) {
     return strchr(url, '?') != NULL;
 }
 
-// handle client requests
-void *handleClient(void *client_sock_ptr) {
-    int client_sock = *((int *)client_sock_ptr);
-    free(client_sock_ptr);  // get socket + free mem for pointer
+// monotonic clock in microseconds
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-            char request[MAX_REQUEST_SIZE];
-            char method[10];
-            char url[MAX_URL_SIZE];
-            char host[MAX_URL_SIZE];
-            char path[MAX_PATH_SIZE];
-            int port;
+// stamp the end of a phase, no-op when tracing is off
+void trace_mark(conn_ctx *conn, int phase) {
+    if (trace_rings == NULL || conn == NULL) return;
+    uint32_t at = (uint32_t)(now_us() - conn->start_mono_us);
+    conn->trace.at_us[phase] = at ? at : 1;  // 0 means not reached
+}
 
-    int bytes_read = recv(client_sock, request, MAX_REQUEST_SIZE - 1, 0);
-    if (bytes_read <= 0) {  //if no data read
-        close(client_sock);
-        return NULL;
+// push the finished record onto a ring this thread claims for the push
+void trace_commit(conn_ctx *conn) {
+    if (trace_rings == NULL) return;
+
+    static atomic_uint next_ring;
+    unsigned int start = atomic_fetch_add_explicit(&next_ring, 1, memory_order_relaxed);
+
+    for (int i = 0; i < TRACE_RINGS; i++) {
+        trace_ring *ring = &trace_rings[(start + i) % TRACE_RINGS];
+        int expected = 0;
+        if (!atomic_compare_exchange_strong_explicit(&ring->in_use, &expected, 1,
+                                                     memory_order_acquire, memory_order_relaxed)) {
+            continue;
+        }
+
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        int pushed = 0;
+        if (head - tail < TRACE_RING_SIZE) {
+            ring->records[head & (TRACE_RING_SIZE - 1)] = conn->trace;
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+            pushed = 1;
+        }
+        atomic_store_explicit(&ring->in_use, 0, memory_order_release);
+        if (pushed) return;
     }
 
-    request[bytes_read] = '\0';
+    atomic_fetch_add(&trace_dropped, 1);  // every ring busy or full
+}
 
-    // parse request
-    parse_request(request, method, url, host, &port, path);
+// drain all rings into the trace file (flusher thread only, then main once it has joined it)
+void trace_flush(void) {
+    for (int i = 0; i < TRACE_RINGS; i++) {
+        trace_ring *ring = &trace_rings[i];
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        while (tail != head) {
+            // copy out the contiguous stretch up to the wrap point
+            unsigned int idx = tail & (TRACE_RING_SIZE - 1);
+            unsigned int count = head - tail;
+            if (count > TRACE_RING_SIZE - idx) count = TRACE_RING_SIZE - idx;
+            fwrite(&ring->records[idx], sizeof(trace_record), count, trace_file);
+            tail += count;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    fflush(trace_file);
+}
 
-    if (!is_valid_request(method)) {
-        char *error_response = "HTTP/1.1 400 Bad Request\r\nContent-Type: text/html\r\n\r\n<html><body><h1>400 Bad Request</h1><p>only GET method supported.</p></body></html>";
-        send(client_sock, error_response, strlen(error_response), 0);
-        close(client_sock);
-        return NULL;
+void *trace_flusher(void *arg) {
+    (void)arg;
+    while (!stop_requested) {
+        usleep(TRACE_FLUSH_MS * 1000);
+        trace_flush();
     }
+    return NULL;
+}
+
+// close the client, record the trace and recycle the connection block
+void finish_conn(conn_ctx *conn) {
+    close(conn->client_sock);
+    trace_commit(conn);
+    pool_put(&conn_pool, conn);
+}
 
-    //get server addy
-    struct hostent *server_host = gethostbyname(host);
+// send a cached response straight from disk, 1 if it was served
+int serve_cached(conn_ctx *conn, const char *cache_key) {
+    int client_sock = conn->client_sock;
+    char cache_path[MAX_CACHE_PATH];
+    sprintf(cache_path, "./cache/%s", cache_key);
 
+    int cache_fd = open(cache_path, O_RDONLY);  //open cache file to read
+    if (cache_fd < 0) {
+        return 0;
+    }
 
-    //check url not dynamic (chachable)
-    int should_cache = !is_dynamic_content(url);
-    char *cache_key = NULL;
+    // plain fds + pooled buffer, no stdio allocations
+    //send can take less than it was given, so each block goes out in as many sends as it needs
+    io_buf *buf = pool_get(&io_pool);
+    ssize_t n;
+    int client_gone = 0;
+    while (buf != NULL && !client_gone && (n = read(cache_fd, buf->data, BUFFER_SIZE)) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            ssize_t sent = send(client_sock, buf->data + off, n - off, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) {
+                client_gone = 1;
+                break;
+            }
+            off += sent;
+        }
+        if (conn->trace.at_us[PH_FIRST_BYTE] == 0) trace_mark(conn, PH_FIRST_BYTE);
+    }
+    trace_mark(conn, PH_LAST_BYTE);
 
-    if (should_cache) {
-        cache_key = hashFunction(url);  //make hash key
-        time_t current_time = time(NULL);
+    pool_put(&io_pool, buf);
+    close(cache_fd);
+    return 1;
+}
 
+// queue bytes for the client, growing the ring from the io pool
+// out of memory the client is given up on (what it has is incomplete), -1
+int relay_push(relay_state *relay, const char *data, int len) {
+    if (relay->client_gone) return 0;
+
+    while (len > 0) {
+        if (relay->tail == NULL || relay->tail->len == BUFFER_SIZE) {
+            io_buf *buf = pool_get(&io_pool);
+            if (buf == NULL) {
+                relay->client_gone = 1;
+                return -1;
+            }
+            buf->next = NULL;
+            buf->len = 0;
+            if (relay->tail != NULL) relay->tail->next = buf; else relay->head = buf;
+            relay->tail = buf;
+            if (relay->send_buf == NULL) {
+                relay->send_buf = buf;
+                relay->send_off = 0;
+            }
+        }
 
-        if (checkCache(cache_key, current_time)) {
-            printf("Cache hit for %s\n", url);  // Cache hit
+        io_buf *tail = relay->tail;
+        int n = BUFFER_SIZE - tail->len;
+        if (n > len) n = len;
+        memcpy(tail->data + tail->len, data, n);
+        tail->len += n;
+        relay->queued_bytes += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
 
-            // read chached files
-            //send to client
-            char cache_path[MAX_CACHE_PATH];
-            sprintf(cache_path, "./cache/%s", cache_key);
+// write as much pending data to the client as it takes, recycling sent buffers
+// returns bytes written, -1 when the client went away
+long relay_drain(relay_state *relay, int client_sock) {
+    long written = 0;
 
-            FILE *cache_file = fopen(cache_path, "rb");  //open cache file to read
-            if (cache_file != NULL) {
-                char buffer[BUFFER_SIZE];
-                size_t bytes_read;
+    while (relay->send_buf != NULL) {
+        io_buf *buf = relay->send_buf;
+        int avail = buf->len - relay->send_off;
 
-                // send data to client sock
-                while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, cache_file)) > 0) {
-                    send(client_sock, buffer, bytes_read, 0);
+        if (avail > 0) {
+            int n = send(client_sock, buf->data + relay->send_off, avail, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+                return -1;
+            }
+            relay->send_off += n;
+            relay->sent_bytes += n;
+            written += n;
+            if (n < avail) break;  // short write, socket buffer is full
+        }
+
+        // move on only once this buffer is full and fully sent
+        if (buf->len < BUFFER_SIZE || buf->next == NULL) break;
+        relay->send_buf = buf->next;
+        relay->send_off = 0;
+        relay->head = buf->next;
+        pool_put(&io_pool, buf);
+    }
+
+    return written;
+}
+
+// copy reply headers minus Transfer-Encoding (and Content-Length when drop_length)
+// the blank line ending the headers is not copied; returns bytes written
+int copy_headers(const char *src, int src_len, char *dst, int dst_cap, int drop_length) {
+    int out = 0;
+    const char *end = src + src_len;
+
+    while (src < end) {
+        const char *eol = memchr(src, '\n', end - src);
+        int line_len = eol ? (int)(eol - src) + 1 : (int)(end - src);
+
+        int blank = (line_len == 1 || (line_len == 2 && src[0] == '\r'));
+        int skip = strncasecmp(src, "transfer-encoding:", 18) == 0 ||
+                   (drop_length && strncasecmp(src, "content-length:", 15) == 0);
+
+        if (!blank && !skip && out + line_len <= dst_cap) {
+            memcpy(dst + out, src, line_len);
+            out += line_len;
+        }
+        src += line_len;
+    }
+    return out;
+}
+
+// open a temp cache file and write the reply headers with a Content-Length
+// placeholder; the body is appended as it arrives
+void cache_begin(cache_fill *fill, const char *cache_key, const char *hdr, int hdr_len) {
+    mkdir("./cache", 0777);  //create dir ide
+    snprintf(fill->final_path, sizeof(fill->final_path), "./cache/%s", cache_key);
+    snprintf(fill->part_path, sizeof(fill->part_path), "./cache/%s.XXXXXX", cache_key);
+
+    fill->fd = mkstemp(fill->part_path);
+    if (fill->fd < 0) {
+        perror("failed to open file");
+        return;
+    }
+    fchmod(fill->fd, 0644);  // mkstemp makes it private
+
+    // headers minus framing, then "Content-Length: <LENGTH_DIGITS spaces>" patched at the end
+    char out[MAX_HEADER_SIZE + 64];
+    int len = copy_headers(hdr, hdr_len, out, MAX_HEADER_SIZE, 1);
+    len += sprintf(out + len, "Content-Length: ");
+    fill->length_at = len;
+    len += sprintf(out + len, "%*s\r\n\r\n", LENGTH_DIGITS, "");
+    fill->body_at = len;
+
+    if (write(fill->fd, out, len) != len) {
+        perror("failed to write cache file");
+        close(fill->fd);
+        unlink(fill->part_path);
+        fill->fd = -1;
+    }
+}
+
+// patch the length in and publish the entry, or throw it away if the reply was cut short
+void cache_finish(cache_fill *fill, long body_len, int complete) {
+    if (fill->fd < 0) return;
+
+    if (complete) {
+        char digits[LENGTH_DIGITS + 1];
+        snprintf(digits, sizeof(digits), "%*ld", LENGTH_DIGITS, body_len);  // leading spaces are legal OWS
+        if (pwrite(fill->fd, digits, LENGTH_DIGITS, fill->length_at) != LENGTH_DIGITS) {
+            complete = 0;
+        }
+    }
+
+    close(fill->fd);
+    fill->fd = -1;
+
+    if (!complete || rename(fill->part_path, fill->final_path) < 0) {
+        unlink(fill->part_path);
+    }
+}
+
+// headers are in: work out how the body is framed
+void reader_headers_done(http_reader *rd) {
+    int status = 0;
+    sscanf(rd->hdr, "HTTP/%*d.%*d %d", &status);
+
+    rd->chunked = 0;
+    rd->remaining = -1;  // close delimited unless told otherwise
+
+    // walk the header lines (skipping the status line)
+    const char *line = strchr(rd->hdr, '\n');
+    while (line != NULL && *++line != '\0') {
+        if (strncasecmp(line, "transfer-encoding:", 18) == 0) {
+            const char *value = line + 18;
+            const char *eol = strchr(value, '\n');
+            for (const char *p = value; p + 7 <= (eol ? eol : value + strlen(value)); p++) {
+                if (strncasecmp(p, "chunked", 7) == 0) rd->chunked = 1;
+            }
+        } else if (strncasecmp(line, "content-length:", 15) == 0) {
+            rd->remaining = atol(line + 15);
+        }
+        line = strchr(line, '\n');
+    }
+
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        rd->state = RD_DONE;  // no body
+    } else if (rd->chunked) {
+        rd->state = RD_CHUNK_SIZE;
+        rd->line_len = 0;
+    } else {
+        rd->state = (rd->remaining == 0) ? RD_DONE : RD_BODY;
+    }
+}
+
+// run origin bytes through the reply parser
+// de-chunked body goes to the cache file and, for decoded_client, to the relay
+void reader_feed(http_reader *rd, const char *data, int len, relay_state *relay, int decoded_client, cache_fill *fill) {
+    while (len > 0 && rd->state != RD_DONE && rd->state != RD_BAD) {
+        switch (rd->state) {
+        case RD_HEADER: {
+            // collect until the blank line, checking across read boundaries
+            int room = MAX_HEADER_SIZE - 1 - rd->hdr_len;
+            int take = len < room ? len : room;
+            int scan_from = rd->hdr_len > 3 ? rd->hdr_len - 3 : 0;
+            memcpy(rd->hdr + rd->hdr_len, data, take);
+            rd->hdr_len += take;
+            rd->hdr[rd->hdr_len] = '\0';
+
+            char *end = strstr(rd->hdr + scan_from, "\r\n\r\n");
+            if (end == NULL) {
+                if (take < len) {
+                    // headers too large to parse: leave this read unconsumed for the caller
+                    rd->hdr_len -= take;
+                    rd->state = RD_BAD;
+                    return;
                 }
+                data += take;
+                len -= take;
+                break;
+            }
 
-                fclose(cache_file);
-                free(cache_key);
-                close(client_sock);
-                return NULL;
+            // give back what belongs to the body
+            int used = (int)(end + 4 - rd->hdr) - (rd->hdr_len - take);
+            rd->hdr_len = (int)(end + 4 - rd->hdr);
+            rd->hdr[rd->hdr_len] = '\0';
+            data += used;
+            len -= used;
+            reader_headers_done(rd);
+            rd->headers_done = 1;
+
+            if (fill != NULL) {
+                cache_begin(fill, fill->key, rd->hdr, rd->hdr_len);
             }
+            if (decoded_client) {
+                // http/1.0 client: same headers without chunked framing, body to close
+                char out[MAX_HEADER_SIZE + 8];
+                int out_len = copy_headers(rd->hdr, rd->hdr_len, out, MAX_HEADER_SIZE, rd->chunked);
+                memcpy(out + out_len, "\r\n", 2);
+                relay_push(relay, out, out_len + 2);
+            }
+            break;
+        }
+
+        case RD_BODY:
+        case RD_CHUNK_DATA: {
+            int take = len;
+            if (rd->remaining >= 0 && rd->remaining < take) take = (int)rd->remaining;
+
+            if (fill != NULL && fill->fd >= 0 && write(fill->fd, data, take) != take) {
+                perror("failed to write cache file");
+                close(fill->fd);
+                unlink(fill->part_path);
+                fill->fd = -1;
+            }
+            if (decoded_client && !relay->spilled) {
+                // past the limit the client is left to catch up from the cache file (relay_catch_up)
+                if (relay->limit > 0 && fill != NULL && fill->fd >= 0 &&
+                    relay->queued_bytes - relay->sent_bytes + take > relay->limit) {
+                    relay->spilled = 1;
+                    relay->resume_at = rd->body_bytes;
+                } else {
+                    relay_push(relay, data, take);
+                }
+            }
+
+            rd->body_bytes += take;
+            data += take;
+            len -= take;
+            if (rd->remaining >= 0) {
+                rd->remaining -= take;
+                if (rd->remaining == 0) {
+                    rd->state = (rd->state == RD_BODY) ? RD_DONE : RD_CHUNK_END;
+                }
+            }
+            break;
+        }
+
+        case RD_CHUNK_SIZE:
+        case RD_CHUNK_END:
+        case RD_TRAILER: {
+            // line based states
+            char c = *data++;
+            len--;
+            if (c != '\n') {
+                if (rd->line_len < (int)sizeof(rd->line) - 1) rd->line[rd->line_len++] = c;
+                break;
+            }
+            if (rd->line_len > 0 && rd->line[rd->line_len - 1] == '\r') rd->line_len--;
+            rd->line[rd->line_len] = '\0';
+
+            if (rd->state == RD_CHUNK_END) {
+                rd->state = RD_CHUNK_SIZE;
+            } else if (rd->state == RD_CHUNK_SIZE) {
+                char *end;
+                long size = strtol(rd->line, &end, 16);  // chunk extensions after ';' are ignored
+                if (end == rd->line || size < 0) {
+                    rd->state = RD_BAD;
+                } else if (size == 0) {
+                    rd->state = RD_TRAILER;
+                } else {
+                    rd->remaining = size;
+                    rd->state = RD_CHUNK_DATA;
+                }
+            } else if (rd->line_len == 0) {
+                rd->state = RD_DONE;  // blank line ends the trailer
+            }
+            rd->line_len = 0;
+            break;
+        }
         }
     }
+}
+
+// queue body bytes from resume_at on, read back from the cache file (body at body_at, body_len
+//bytes so far), up to the limit; back to live relaying once caught up. -1 if the file can't be read
+int relay_catch_up(relay_state *relay, int fd, off_t body_at, long body_len) {
+    char buf[BUFFER_SIZE];
+    while (relay->spilled && relay->queued_bytes - relay->sent_bytes < relay->limit) {
+        long want = body_len - relay->resume_at;
+        if (want == 0) {
+            relay->spilled = 0;
+            break;
+        }
+        ssize_t got = pread(fd, buf, want < BUFFER_SIZE ? want : BUFFER_SIZE, body_at + relay->resume_at);
+        if (got <= 0 || relay_push(relay, buf, got) < 0) {
+            return -1;
+        }
+        relay->resume_at += got;
+    }
+    return 0;
+}
+
+// connect to addr, send out_request and relay the reply to the client
+// the upstream request is http/1.1, so the reply may be chunked: http/1.1
+// clients get the origin bytes as they arrive (first byte goes straight out),
+// http/1.0 clients get it de-chunked; the cache always gets the de-chunked
+// body with a known Content-Length, written to disk as it streams
+// origin reads pause above relay_high_water buffered bytes and resume below
+// relay_low_water; with fill_through a cacheable reply is read at origin
+// speed (and finished even if the client leaves) while the client's queue
+// stays capped at relay_high_water: what doesn't fit is read back from the
+// cache file once the client drains below relay_low_water
+// returns bytes relayed, -1 if the connection failed
+long relay_response(conn_ctx *conn, struct sockaddr_in *addr, const char *out_request, const char *cache_key, int client_http11) {
+    int client_sock = conn->client_sock;
+    size_t arena_mark = conn->arena.used;  // reader scratch is released on return
+
+    http_reader rd;
+    memset(&rd, 0, sizeof(rd));
+    rd.hdr = arena_alloc(&conn->arena, MAX_HEADER_SIZE);
+    io_buf *in = pool_get(&io_pool);
+    if (rd.hdr == NULL || in == NULL) {
+        pool_put(&io_pool, in);
+        conn->arena.used = arena_mark;
+        return -1;
+    }
 
-    // connect to server
     int server_sock = socket(AF_INET, SOCK_STREAM, 0);  // make server socket
     if (server_sock < 0) {
         perror("server socket creation failed");
-        close(client_sock);
-        if (cache_key != NULL) free(cache_key);
-        return NULL;
+        pool_put(&io_pool, in);
+        conn->arena.used = arena_mark;
+        return -1;
     }
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));  //zero out struct
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);//set pot
-    memcpy(&server_addr.sin_addr.s_addr, server_host->h_addr, server_host->h_length); //copy ip
-
     // connect origin server
-    if (connect(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    if (connect(server_sock, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
         perror("failed to connect server");
         close(server_sock);
-        close(client_sock);
-        if (cache_key != NULL) free(cache_key);
-        return NULL;
+        pool_put(&io_pool, in);
+        conn->arena.used = arena_mark;
+        return -1;
     }
+    trace_mark(conn, PH_CONNECT);
 
-    // modify to standard http + send to server
-    char new_request[MAX_REQUEST_SIZE];
-    sprintf(new_request, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", path, host);
-    send(server_sock, new_request, strlen(new_request), 0);
+    send(server_sock, out_request, strlen(out_request), 0);
+
+    // both ends non-blocking from here on
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) | O_NONBLOCK);
+    fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL) | O_NONBLOCK);
+
+    relay_state relay;
+    memset(&relay, 0, sizeof(relay));
+
+    // cache_begin runs once the headers are parsed
+    cache_fill fill;
+    cache_fill *fillp = NULL;
+    if (cache_key != NULL) {
+        memset(&fill, 0, sizeof(fill));
+        fill.fd = -1;
+        strncpy(fill.key, cache_key, sizeof(fill.key) - 1);
+        fillp = &fill;
+    }
 
-    // get response
-    //forward to client
-    char buffer[BUFFER_SIZE];
-    char *full_response = NULL;//potentially cache
-    int total_bytes = 0;
-    int response_capacity = 0;
+    // a fill-through reply goes out decoded even to http/1.1 clients (close delimited), so what the
+    //client is owed past the cap is exactly the cache file's body
+    int raw_client = client_http11 && !(fillp != NULL && fill_through);  // passthrough, else wait for headers and decode
+    int origin_done = 0;   // eof, error or end of the framed body
+    int parse_failed = 0;
+    int paused = 0;
+    if (fillp != NULL && fill_through) relay.limit = relay_high_water;
 
     while (1) {
-        int bytes_received = recv(server_sock, buffer, BUFFER_SIZE, 0); //get data from origin
+        // fill-through only while the cache file is there to read back from
+        int throttle = !(fillp != NULL && fill_through && (!rd.headers_done || fill.fd >= 0));
+
+        if (relay.spilled && !relay.client_gone) {
+            if (fillp == NULL || fill.fd < 0) {
+                // the part the client is missing is gone with the cache file
+                relay.client_gone = 1;
+                release_chain(relay.head);
+                relay.head = relay.tail = relay.send_buf = NULL;
+                shutdown(client_sock, SHUT_RDWR);
+            } else if (relay.queued_bytes - relay.sent_bytes <= relay_low_water &&
+                       relay_catch_up(&relay, fill.fd, fill.body_at, rd.body_bytes) < 0) {
+                relay.client_gone = 1;
+                release_chain(relay.head);
+                relay.head = relay.tail = relay.send_buf = NULL;
+            }
+        }
+
+        long pending = relay.queued_bytes - relay.sent_bytes;
+        if (relay.client_gone) pending = 0;
+
+        // finished once origin is done and everything is out
+        if (origin_done && pending == 0 && (!relay.spilled || relay.client_gone)) break;
+        // nobody left to serve and nothing worth finishing
+        if (relay.client_gone && throttle) break;
+
+        // watermarks only throttle when the bytes would otherwise pile up for the client
+        if (throttle) {
+            if (!paused && pending >= relay_high_water) paused = 1;
+            else if (paused && pending <= relay_low_water) paused = 0;
+        }
+
+        struct pollfd pfds[2];
+        int nfds = 0;
+        int origin_idx = -1, client_idx = -1;
+        if (!origin_done && !paused) {
+            pfds[nfds] = (struct pollfd){server_sock, POLLIN, 0};
+            origin_idx = nfds++;
+        }
+        if (!relay.client_gone && pending > 0) {
+            pfds[nfds] = (struct pollfd){client_sock, POLLOUT, 0};
+            client_idx = nfds++;
+        }
+
+        int ready = poll(pfds, nfds, RELAY_IDLE_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) {
+            break;  // idle too long (or poll failed), give up on this reply
+        }
+
+        if (origin_idx >= 0 && pfds[origin_idx].revents) {
+            int n = recv(server_sock, in->data, BUFFER_SIZE, 0);
+            if (n > 0) {
+                if (raw_client) relay_push(&relay, in->data, n);
+                reader_feed(&rd, in->data, n, &relay, !raw_client, fillp);
+
+                if (rd.state == RD_BAD && !parse_failed) {
+                    // can't parse it: no cache, hand everything over untouched
+                    //unless decoded headers already went out, then there is no sound way on: drop the client
+                    parse_failed = 1;
+                    if (fillp != NULL) cache_finish(fillp, 0, 0);
+                    fillp = NULL;
+                    if (!raw_client && rd.headers_done) {
+                        origin_done = 1;
+                        relay.client_gone = 1;
+                        release_chain(relay.head);
+                        relay.head = relay.tail = relay.send_buf = NULL;
+                        shutdown(client_sock, SHUT_RDWR);
+                    } else if (!raw_client) {
+                        relay_push(&relay, rd.hdr, rd.hdr_len);
+                        relay_push(&relay, in->data, n);
+                        raw_client = 1;
+                    }
+                } else if (rd.state == RD_DONE) {
+                    origin_done = 1;  // framed body complete, no need to wait for close
+                }
+            } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                origin_done = 1;
+            }
+        }
+
+        if (client_idx >= 0 && pfds[client_idx].revents) {
+            long before = relay.sent_bytes;
+            if (relay_drain(&relay, client_sock) < 0) {
+                relay.client_gone = 1;
+                release_chain(relay.head);
+                relay.head = relay.tail = relay.send_buf = NULL;
+            } else if (before == 0 && relay.sent_bytes > 0) {
+                trace_mark(conn, PH_FIRST_BYTE);
+            }
+        }
+    }
+
+    // back to blocking for whatever the caller does next
+    fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL) & ~O_NONBLOCK);
+    trace_mark(conn, PH_LAST_BYTE);
+
+//cache if needed (complete replies only)
+    if (fillp != NULL) {
+        int complete = rd.state == RD_DONE ||
+                       (origin_done && rd.state == RD_BODY && rd.remaining < 0);  // closed by origin
+        cache_finish(fillp, rd.body_bytes, complete);
+        if (complete) trace_mark(conn, PH_CACHE_WRITE);
+    }
+
+    release_chain(relay.head);
+    pool_put(&io_pool, in);
+    close(server_sock);
+    conn->arena.used = arena_mark;
+    return relay.sent_bytes;
+}
+
+// parse "host:port[:udp_port]" into a peer entry
+int parse_peer(const char *spec, peer_t *peer) {
+    char host[64];
+    int http_port = 0, udp_port = 0;
+
+    if (sscanf(spec, "%63[^:]:%d:%d", host, &http_port, &udp_port) < 2) {
+        return -1;
+    }
+
+    struct hostent *peer_host = gethostbyname(host);
+    if (peer_host == NULL) {
+        return -1;
+    }
+
+    memset(peer, 0, sizeof(*peer));
+    strncpy(peer->name, spec, sizeof(peer->name) - 1);
+    peer->http_addr.sin_family = AF_INET;
+    peer->http_addr.sin_port = htons(http_port);
+    memcpy(&peer->http_addr.sin_addr.s_addr, peer_host->h_addr, peer_host->h_length);
+    peer->udp_addr = peer->http_addr;
+    peer->udp_addr.sin_port = htons(udp_port);
+    return 0;
+}
+
+// ask every sibling whether it holds cache_key
+// returns index of the first sibling that answered HIT, -1 otherwise
+int query_siblings(const char *cache_key) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    unsigned int req_id = (unsigned int)atomic_fetch_add(&icp_next_id, 1);
+    char msg[64];
+    int msg_len = snprintf(msg, sizeof(msg), "ICPQ %u %s", req_id, cache_key);
+    int asked = 0;
+
+    for (int i = 0; i < sibling_count; i++) {
+        if (sendto(sock, msg, msg_len, 0, (struct sockaddr *)&siblings[i].udp_addr, sizeof(siblings[i].udp_addr)) == msg_len) {
+            asked++;
+        }
+    }
 
-        if (bytes_received <= 0) {
+    // collect replies until everyone answered or the wait runs out
+    int hit = -1;
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+
+    while (asked > 0 && hit < 0) {
+        gettimeofday(&now, NULL);
+        long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+        if (elapsed_ms >= peer_wait_ms) {
             break;
         }
 
-        send(client_sock, buffer, bytes_received, 0);  //send data to client
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, peer_wait_ms - elapsed_ms) <= 0) {
+            break;
+        }
+
+        char reply[80];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int n = recvfrom(sock, reply, sizeof(reply) - 1, 0, (struct sockaddr *)&from, &from_len);
+        if (n <= 0) {
+            continue;
+        }
+        reply[n] = '\0';
 
-        // store response data
-        if (should_cache) {
-            if (total_bytes + bytes_received > response_capacity) {
-                response_capacity = (total_bytes + bytes_received) * 2;
-                full_response = realloc(full_response, response_capacity);//expand buff for full response
-                if (full_response == NULL) {
-                    should_cache = 0;//if mem allocation fails
+        unsigned int reply_id;
+        char status[8], key[33];
+        if (sscanf(reply, "ICPR %u %7s %32s", &reply_id, status, key) != 3 ||
+            reply_id != req_id || strcmp(key, cache_key) != 0) {
+            continue;  // stale or unrelated
+        }
+        asked--;
+
+        if (strcmp(status, "HIT") == 0) {
+            for (int i = 0; i < sibling_count; i++) {
+                if (siblings[i].udp_addr.sin_addr.s_addr == from.sin_addr.s_addr &&
+                    siblings[i].udp_addr.sin_port == from.sin_port) {
+                    hit = i;
+                    break;
                 }
             }
+        }
+    }
+
+    close(sock);
+    return hit;
+}
+
+// answer sibling queries from the local cache
+void *icp_responder(void *arg) {
+    int sock = *(int *)arg;
+
+    while (1) {
+        char msg[80];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int n = recvfrom(sock, msg, sizeof(msg) - 1, 0, (struct sockaddr *)&from, &from_len);
+        if (n <= 0) {
+            continue;
+        }
+        msg[n] = '\0';
+
+        unsigned int req_id;
+        char key[33];
+        if (sscanf(msg, "ICPQ %u %32s", &req_id, key) != 2 || !is_cache_key(key)) {
+            continue;
+        }
 
-            if (full_response != NULL) {
-                memcpy(full_response + total_bytes, buffer, bytes_received);  //add data to full response
-                total_bytes += bytes_received;
+        char reply[80];
+        int reply_len = snprintf(reply, sizeof(reply), "ICPR %u %s %s", req_id,
+                                 checkCache(key, time(NULL)) ? "HIT" : "MISS", key);
+        sendto(sock, reply, reply_len, 0, (struct sockaddr *)&from, from_len);
+    }
+
+    return NULL;
+}
+
+// 32 lowercase hex chars, as made by hashFunction
+int is_cache_key(const char *key) {
+    int i;
+    for (i = 0; key[i] != '\0'; i++) {
+        if (!isxdigit((unsigned char)key[i]) || isupper((unsigned char)key[i])) {
+            return 0;
+        }
+    }
+    return i == 32;
+}
+
+// handle client requests
+void *handleClient(void *conn_ptr) {
+    conn_ctx *conn = (conn_ctx *)conn_ptr;
+    int client_sock = conn->client_sock;
+    arena_t *arena = &conn->arena;
+
+    // request scratch space lives in the connection arena, not on the thread stack
+    char *request = arena_alloc(arena, MAX_REQUEST_SIZE);
+    char *url = arena_alloc(arena, MAX_URL_SIZE);
+    char *host = arena_alloc(arena, MAX_URL_SIZE);
+    char *path = arena_alloc(arena, MAX_PATH_SIZE);
+    char *cache_key = arena_alloc(arena, 33);
+    char method[10] = "";
+    int port;
+
+    if (request == NULL || url == NULL || host == NULL || path == NULL || cache_key == NULL) {
+        finish_conn(conn);
+        return NULL;
+    }
+    url[0] = host[0] = path[0] = '\0';
+
+    int bytes_read = recv(client_sock, request, MAX_REQUEST_SIZE - 1, 0);
+    if (bytes_read <= 0) {  //if no data read
+        finish_conn(conn);
+        return NULL;
+    }
+
+    request[bytes_read] = '\0';
+
+    // http/1.1 clients can take the origin's chunked framing as is
+    char *first_eol = strstr(request, "\r\n");
+    char *version = strstr(request, " HTTP/1.1");
+    int client_http11 = version != NULL && (first_eol == NULL || version < first_eol);
+
+    // parse request
+    parse_request(request, method, url, host, &port, path);
+    trace_mark(conn, PH_REQUEST);
+    strncpy(conn->trace.host, host, sizeof(conn->trace.host) - 1);
+    conn->trace.outcome = OUT_ERROR;  // until something answers
+
+    // requests addressed to the proxy itself
+    if (host[0] == '\0' && strcmp(path, "/proxy-stats") == 0) {
+        send_stats(client_sock);
+        finish_conn(conn);
+        return NULL;
+    }
+
+    // sibling fetch: serve only from cache, close empty on a miss
+    if (host[0] == '\0' && strncmp(path, "/peer-cache/", 12) == 0) {
+        const char *key = path + 12;
+        if (is_cache_key(key) && checkCache(key, time(NULL))) {
+            serve_cached(conn, key);
+        }
+        finish_conn(conn);
+        return NULL;
+    }
+
+    if (!is_valid_request(method)) {
+        char *error_response = "HTTP/1.1 400 Bad Request\r\nContent-Type: text/html\r\n\r\n<html><body><h1>400 Bad Request</h1><p>only GET method supported.</p></body></html>";
+        send(client_sock, error_response, strlen(error_response), 0);
+        finish_conn(conn);
+        return NULL;
+    }
+
+    //check url not dynamic (chachable)
+    int should_cache = !is_dynamic_content(url);
+
+    if (should_cache) {
+        hashFunction(url, cache_key);  //make hash key
+        time_t current_time = time(NULL);
+
+        int cached = checkCache(cache_key, current_time);
+        trace_mark(conn, PH_CACHE);
+
+        if (cached && serve_cached(conn, cache_key)) {
+            printf("Cache hit for %s\n", url);  // Cache hit
+            conn->trace.outcome = OUT_HIT;
+            finish_conn(conn);
+            return NULL;
+        }
+    }
+
+    // request text is no longer needed, reuse its arena space for the outgoing one
+    char *new_request = request;
+
+    // local miss: try a sibling that has it before going upstream
+    if (should_cache && sibling_count > 0) {
+        int sibling = query_siblings(cache_key);
+        trace_mark(conn, PH_PEER);
+        if (sibling >= 0) {
+            snprintf(new_request, MAX_REQUEST_SIZE, "GET /peer-cache/%s HTTP/1.1\r\nConnection: close\r\n\r\n", cache_key);
+            if (relay_response(conn, &siblings[sibling].http_addr, new_request, cache_key, client_http11) > 0) {
+                printf("Sibling hit for %s from %s\n", url, siblings[sibling].name);
+                conn->trace.outcome = OUT_SIBLING;
+                finish_conn(conn);
+                return NULL;
             }
         }
     }
 
-//cache if needed
-    if (should_cache && full_response != NULL) {
-        cacheResponse(cache_key, full_response, total_bytes);
-        free(full_response);
+    struct sockaddr_in server_addr;
+
+    if (has_parent) {
+        // parent proxy fetches (and caches) on our behalf
+        server_addr = parent.http_addr;
+        snprintf(new_request, MAX_REQUEST_SIZE, "GET http://%s:%d%s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", host, port, path, host);
+    } else {
+        //get server addy (only needed on a miss)
+        struct hostent *server_host = gethostbyname(host);
+        trace_mark(conn, PH_DNS);
+        if (server_host == NULL) {
+            char *error_response = "HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\n\r\n<html><body><h1>404 Not Found</h1><p>could not resolve host.</p></body></html>";
+            send(client_sock, error_response, strlen(error_response), 0);
+            finish_conn(conn);
+            return NULL;
+        }
+
+        memset(&server_addr, 0, sizeof(server_addr));  //zero out struct
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);//set pot
+        memcpy(&server_addr.sin_addr.s_addr, server_host->h_addr, server_host->h_length); //copy ip
+
+        // modify to standard http + send to server (1.1 so origins can stream chunked)
+        snprintf(new_request, MAX_REQUEST_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, host);
+    }
+
+    if (relay_response(conn, &server_addr, new_request, should_cache ? cache_key : NULL, client_http11) >= 0) {
+        conn->trace.outcome = OUT_MISS;
     }
 
 ///cleanup
-    if (cache_key != NULL) free(cache_key);//
-    close(server_sock);
-    close(client_sock);
+    finish_conn(conn);
     return NULL;
 }
 
 int main(int argc, char *argv[]) {
-    // get port + timeout args
-    if (argc != 3) {
-        printf("usage: %s <port> <timeout>\n", argv[0]);
+    // get port + timeout args, then optional peering flags
+    if (argc < 3) {
+        printf("usage: %s <port> <timeout> [-u icp_port] [-s host:port:icp_port]... [-P host:port] [-w wait_ms] [-t trace_file] [-H high_bytes] [-L low_bytes] [-F]\n", argv[0]);
         return 1;
     }
     int port = atoi(argv[1]);
     timeout_seconds = atoi(argv[2]);
+    int icp_port = 0;
+    char *trace_path = NULL;
+    pthread_t flush_thread;
+
+    for (int i = 3; i < argc; i++) {
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "-F") == 0) {
+            fill_through = 1;
+            continue;
+        }
+        if (val == NULL) {
+            printf("missing value for %s\n", argv[i]);
+            return 1;
+        }
+        i++;
+
+        if (strcmp(argv[i - 1], "-u") == 0) {
+            icp_port = atoi(val);
+        } else if (strcmp(argv[i - 1], "-s") == 0 && sibling_count < MAX_PEERS) {
+            if (parse_peer(val, &siblings[sibling_count]) < 0 || siblings[sibling_count].udp_addr.sin_port == 0) {
+                printf("bad sibling %s (want host:port:icp_port)\n", val);
+                return 1;
+            }
+            sibling_count++;
+        } else if (strcmp(argv[i - 1], "-P") == 0) {
+            if (parse_peer(val, &parent) < 0) {
+                printf("bad parent %s (want host:port)\n", val);
+                return 1;
+            }
+            has_parent = 1;
+        } else if (strcmp(argv[i - 1], "-w") == 0) {
+            peer_wait_ms = atoi(val);
+        } else if (strcmp(argv[i - 1], "-t") == 0) {
+            trace_path = (char *)val;
+        } else if (strcmp(argv[i - 1], "-H") == 0) {
+            relay_high_water = atol(val);
+        } else if (strcmp(argv[i - 1], "-L") == 0) {
+            relay_low_water = atol(val);
+        } else {
+            printf("unknown option %s\n", argv[i - 1]);
+            return 1;
+        }
+    }
+
+    if (relay_high_water < BUFFER_SIZE || relay_low_water < 0 || relay_low_water >= relay_high_water) {
+        printf("watermarks need %d <= high and 0 <= low < high\n", BUFFER_SIZE);
+        return 1;
+    }
 
     // signal handler setup
-    signal(SIGINT, cleanup);
+    //SIGINT stays blocked outside main's pselect (threads inherit the mask), so it always lands there
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = cleanup;
+    sigaction(SIGINT, &sa, NULL);
+    sigset_t block_int, wait_mask;
+    sigemptyset(&block_int);
+    sigaddset(&block_int, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &block_int, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
 
     // create server socket
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -361,33 +1356,105 @@ int main(int argc, char *argv[]) {
     printf("server running on port %d w/ cache timeout of %d seconds\n", port, timeout_seconds);
     printf("Ctrl+C to stop the server\n");
 
+    // per-request phase tracing
+    if (trace_path != NULL) {
+        trace_file = fopen(trace_path, "wb");
+        trace_rings = calloc(TRACE_RINGS, sizeof(trace_ring));
+        if (trace_file == NULL || trace_rings == NULL) {
+            perror("failed to set up tracing");
+            return 1;
+        }
+
+        trace_file_header header = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record), TRACE_PHASES};
+        fwrite(&header, sizeof(header), 1, trace_file);
+
+        if (pthread_create(&flush_thread, NULL, trace_flusher, NULL) != 0) {
+            perror("failed to start trace flusher");
+            return 1;
+        }
+        printf("tracing requests to %s\n", trace_path);
+    }
+
+    // answer sibling cache queries
+    if (icp_port > 0) {
+        static int icp_sock;
+        icp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in icp_addr;
+        memset(&icp_addr, 0, sizeof(icp_addr));
+        icp_addr.sin_family = AF_INET;
+        icp_addr.sin_addr.s_addr = INADDR_ANY;
+        icp_addr.sin_port = htons(icp_port);
+
+        pthread_t icp_thread;
+        if (icp_sock < 0 || bind(icp_sock, (struct sockaddr *)&icp_addr, sizeof(icp_addr)) < 0 ||
+            pthread_create(&icp_thread, NULL, icp_responder, &icp_sock) != 0) {
+            perror("failed to start icp responder");
+            return 1;
+        }
+        pthread_detach(icp_thread);
+        printf("answering cache queries on udp port %d\n", icp_port);
+    }
+
     // create cache dir (if there isn''t one already)
     mkdir("./cache", 0777);
 
     // handle client connections
-    while (1) {
+    while (!stop_requested) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
 
-        int *client_sock = malloc(sizeof(int));  // Allocate memory for the client socket
+        // wait for a client with SIGINT let through
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(server_fd, &ready);
+        if (pselect(server_fd + 1, &ready, NULL, NULL, NULL, &wait_mask) < 0) {
+            if (errno != EINTR) perror("Failed to wait for connection");
+            continue;
+        }
+
+        conn_ctx *conn = pool_get(&conn_pool);  // recycled connection block (socket + arena)
+        if (conn == NULL) {
+            perror("Failed to allocate connection");
+            continue;
+        }
+        conn->arena.base = (char *)(conn + 1);
+        conn->arena.size = ARENA_SIZE;
+        conn->arena.used = 0;
+        if (trace_rings != NULL) {
+            memset(&conn->trace, 0, sizeof(conn->trace));
+        }
 
-        *client_sock = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);  // Accept client connection
+        conn->client_sock = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);  // Accept client connection
 
-        if (*client_sock < 0) {
+        if (conn->client_sock < 0) {
             perror("Failed to accept connection");
-            free(client_sock);
+            pool_put(&conn_pool, conn);
             continue;
         }
+        if (trace_rings != NULL) {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            conn->trace.start_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+            conn->start_mono_us = now_us();
+        }
 
         // thread to handle requests
         pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handleClient, client_sock) != 0) {
+        if (pthread_create(&thread_id, NULL, handleClient, conn) != 0) {
             perror("failed to thread");
-            close(*client_sock);
-            free(client_sock);
+            close(conn->client_sock);
+            pool_put(&conn_pool, conn);
+            continue;
         }
         pthread_detach(thread_id);
     }
 
+    printf("\nclosing proxy server\n");
+    close(server_fd);  //close socket
+    if (trace_file != NULL) {
+        pthread_join(flush_thread, NULL);
+        trace_flush();  // don't lose the last batch
+        fclose(trace_file);
+    }
     return 0;
 }
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "proxy_trace.h"
+
+// summarize a proxy -t trace file: latency percentiles per phase, overall and per host
+
+typedef struct {
+    char host[55];
+    int count;
+} host_entry;
+
+int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of a sorted array
+uint32_t percentile(uint32_t *values, int count, double pct) {
+    int rank = (int)(pct / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return values[rank - 1];
+}
+
+// duration of phase p = time since the previous phase that was reached
+int phase_duration(const trace_record *rec, int phase, uint32_t *out) {
+    if (rec->at_us[phase] == 0) {
+        return 0;
+    }
+    uint32_t prev = 0;
+    for (int p = phase - 1; p >= 0; p--) {
+        if (rec->at_us[p] != 0) {
+            prev = rec->at_us[p];
+            break;
+        }
+    }
+    *out = rec->at_us[phase] - prev;
+    return 1;
+}
+
+// total time = last phase reached
+uint32_t total_duration(const trace_record *rec) {
+    for (int p = TRACE_PHASES - 1; p >= 0; p--) {
+        if (rec->at_us[p] != 0) return rec->at_us[p];
+    }
+    return 0;
+}
+
+void print_row(const char *name, uint32_t *values, int count) {
+    if (count == 0) return;
+    qsort(values, count, sizeof(uint32_t), cmp_u32);
+    printf("  %-12s %8d %10u %10u %10u %10u\n", name, count,
+           percentile(values, count, 50), percentile(values, count, 90),
+           percentile(values, count, 99), values[count - 1]);
+}
+
+// per-phase table for all records matching host (NULL = all)
+void print_table(trace_record *records, int count, const char *host, uint32_t *scratch) {
+    printf("  %-12s %8s %10s %10s %10s %10s\n", "phase(us)", "count", "p50", "p90", "p99", "max");
+
+    for (int p = 0; p < TRACE_PHASES; p++) {
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            if (host != NULL && strcmp(records[i].host, host) != 0) continue;
+            if (phase_duration(&records[i], p, &scratch[n])) n++;
+        }
+        print_row(trace_phase_names[p], scratch, n);
+    }
+
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (host != NULL && strcmp(records[i].host, host) != 0) continue;
+        scratch[n++] = total_duration(&records[i]);
+    }
+    print_row("total", scratch, n);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        printf("usage: %s <trace_file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        perror("error opening trace file");
+        return 1;
+    }
+
+    trace_file_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, 4) != 0 ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(trace_record)) {
+        printf("error: %s is not a version %d proxy trace\n", argv[1], TRACE_VERSION);
+        fclose(file);
+        return 1;
+    }
+
+    // load every record
+    int capacity = 1024, count = 0;
+    trace_record *records = malloc(capacity * sizeof(trace_record));
+    while (records != NULL && fread(&records[count], sizeof(trace_record), 1, file) == 1) {
+        records[count].host[sizeof(records[count].host) - 1] = '\0';
+        if (++count == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(trace_record));
+        }
+    }
+    fclose(file);
+
+    if (records == NULL) {
+        perror("memory allocation failed");
+        return 1;
+    }
+
+    int outcomes[5] = {0};
+    for (int i = 0; i < count; i++) {
+        if (records[i].outcome < 5) outcomes[records[i].outcome]++;
+    }
+    printf("%d requests: %d hit, %d sibling, %d miss, %d error\n\n",
+           count, outcomes[OUT_HIT], outcomes[OUT_SIBLING], outcomes[OUT_MISS], outcomes[OUT_ERROR]);
+    if (count == 0) {
+        free(records);
+        return 0;
+    }
+
+    uint32_t *scratch = malloc(count * sizeof(uint32_t));
+    host_entry *hosts = malloc(count * sizeof(host_entry));
+    int host_count = 0;
+
+    printf("all hosts\n");
+    print_table(records, count, NULL, scratch);
+
+    // distinct hosts, busiest first
+    for (int i = 0; i < count; i++) {
+        int found = 0;
+        for (int j = 0; j < host_count; j++) {
+            if (strcmp(hosts[j].host, records[i].host) == 0) {
+                hosts[j].count++;
+                found = 1;
+                break;
+            }
+        }
+        if (!found) {
+            memcpy(hosts[host_count].host, records[i].host, sizeof(hosts[host_count].host));
+            hosts[host_count].count = 1;
+            host_count++;
+        }
+    }
+    for (int i = 1; i < host_count; i++) {
+        host_entry tmp = hosts[i];
+        int j = i - 1;
+        while (j >= 0 && hosts[j].count < tmp.count) {
+            hosts[j + 1] = hosts[j];
+            j--;
+        }
+        hosts[j + 1] = tmp;
+    }
+
+    for (int i = 0; i < host_count; i++) {
+        printf("\nhost %s\n", hosts[i].host[0] ? hosts[i].host : "(none)");
+        print_table(records, count, hosts[i].host, scratch);
+    }
+
+    free(hosts);
+    free(scratch);
+    free(records);
+    return 0;
+}
@@ -0,0 +1,52 @@
+// binary trace format shared by proxy (-t) and proxy_trace
+#ifndef PROXY_TRACE_H
+#define PROXY_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "PXTR"
+#define TRACE_VERSION 1
+
+// phases of handleClient, in the order they can finish
+enum {
+    PH_REQUEST,     // request read + parsed
+    PH_CACHE,       // local cache lookup
+    PH_PEER,        // sibling query
+    PH_DNS,         // gethostbyname
+    PH_CONNECT,     // connect to origin / peer / parent
+    PH_FIRST_BYTE,  // first response byte sent to client
+    PH_LAST_BYTE,   // response fully relayed
+    PH_CACHE_WRITE, // response stored in cache
+    TRACE_PHASES
+};
+
+// how the request was answered
+enum {
+    OUT_NONE,
+    OUT_HIT,
+    OUT_SIBLING,
+    OUT_MISS,
+    OUT_ERROR
+};
+
+static const char *const trace_phase_names[TRACE_PHASES] = {
+    "request", "cache", "peer", "dns", "connect", "first_byte", "last_byte", "cache_write"
+};
+
+// written once at the start of the file
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t phases;
+} trace_file_header;
+
+// one request; at_us[p] is us since start when phase p finished, 0 if never reached
+typedef struct {
+    uint64_t start_us;           // wall clock at accept
+    uint32_t at_us[TRACE_PHASES];
+    uint8_t outcome;
+    char host[55];
+} trace_record;
+
+#endif
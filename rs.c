@@ -0,0 +1,217 @@
+#include <string.h>
+#include <pthread.h>
+#include "rs.h"
+
+// the pshufb kernels are x86 only, elsewhere the scalar kernel is the only one
+#if defined(__x86_64__) || defined(__i386__)
+#define GF_X86 1
+#include <immintrin.h>
+#endif
+
+// GF(2^8) with the usual 0x11d polynomial
+//products of a buffer by a constant c use two 16 entry tables, c * low nibble and c * high nibble,
+//which is exactly what pshufb looks up 16 (ssse3) or 32 (avx2) bytes at a time
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void gf_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+static void (*gf_kernel)(uint8_t *, const uint8_t *, uint8_t, size_t) = gf_mul_add_scalar;
+static const char *gf_kernel_label = "scalar";
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+// c * x for every low nibble x, and for every high nibble
+static void gf_nibble_tables(uint8_t c, uint8_t lo[16], uint8_t hi[16]) {
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul(c, x);
+        hi[x] = gf_mul(c, x << 4);
+    }
+}
+
+static void gf_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    for (size_t i = 0; i < len; i++) {
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+    }
+}
+
+#ifdef GF_X86
+__attribute__((target("ssse3")))
+static void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    for (; i < len; i++) {
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+    }
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    for (; i < len; i++) {
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+    }
+}
+#endif
+
+// log/exp tables and the best kernel for this cpu
+static void gf_setup(void) {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+
+#ifdef GF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        gf_kernel = gf_mul_add_avx2;
+        gf_kernel_label = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        gf_kernel = gf_mul_add_ssse3;
+        gf_kernel_label = "ssse3";
+    }
+#endif
+}
+
+const char *gf_kernel_name(void) {
+    pthread_once(&gf_once, gf_setup);
+    return gf_kernel_label;
+}
+
+int gf_set_kernel(const char *name) {
+    pthread_once(&gf_once, gf_setup);
+    if (strcmp(name, "scalar") == 0) {
+        gf_kernel = gf_mul_add_scalar;
+#ifdef GF_X86
+    } else if (strcmp(name, "ssse3") == 0 && __builtin_cpu_supports("ssse3")) {
+        gf_kernel = gf_mul_add_ssse3;
+    } else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        gf_kernel = gf_mul_add_avx2;
+#endif
+    } else {
+        return -1;
+    }
+    gf_kernel_label = name;
+    return 0;
+}
+
+void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if (c == 0) return;
+    gf_kernel(dst, src, c, len);
+}
+
+int rs_init(rs_code *rs, int k, int m) {
+    pthread_once(&gf_once, gf_setup);
+    if (k < 1 || m < 0 || k + m > RS_MAX_SHARDS) {
+        return -1;
+    }
+    rs->k = k;
+    rs->m = m;
+
+    // identity on top, Cauchy 1 / (x_i + y_j) below with x_i = k + i, y_j = j (all distinct),
+    //every square submatrix of a Cauchy matrix is invertible so any k rows will do
+    memset(rs->matrix, 0, sizeof(rs->matrix));
+    for (int r = 0; r < k; r++) {
+        rs->matrix[r * k + r] = 1;
+    }
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < k; j++) {
+            rs->matrix[(k + i) * k + j] = gf_inv((uint8_t)((k + i) ^ j));
+        }
+    }
+    return 0;
+}
+
+void rs_combine(const uint8_t *coeffs, int n, const uint8_t *const *src, uint8_t *out, size_t len) {
+    memset(out, 0, len);
+    for (int i = 0; i < n; i++) {
+        gf_mul_add(out, src[i], coeffs[i], len);
+    }
+}
+
+void rs_encode_row(const rs_code *rs, int shard, const uint8_t *const *data, uint8_t *out, size_t len) {
+    rs_combine(rs->matrix + shard * rs->k, rs->k, data, out, len);
+}
+
+// Gauss-Jordan inverse of the generator rows that were received
+int rs_decoder(const rs_code *rs, const int *rows, uint8_t *decode) {
+    int k = rs->k;
+    uint8_t work[RS_MAX_SHARDS * RS_MAX_SHARDS];
+
+    for (int i = 0; i < k; i++) {
+        memcpy(work + i * k, rs->matrix + rows[i] * k, k);
+        memset(decode + i * k, 0, k);
+        decode[i * k + i] = 1;
+    }
+
+    for (int col = 0; col < k; col++) {
+        int pivot = col;
+        while (pivot < k && work[pivot * k + col] == 0) pivot++;
+        if (pivot == k) {
+            return -1;
+        }
+        if (pivot != col) {
+            for (int j = 0; j < k; j++) {
+                uint8_t t = work[col * k + j]; work[col * k + j] = work[pivot * k + j]; work[pivot * k + j] = t;
+                t = decode[col * k + j]; decode[col * k + j] = decode[pivot * k + j]; decode[pivot * k + j] = t;
+            }
+        }
+
+        uint8_t scale = gf_inv(work[col * k + col]);
+        for (int j = 0; j < k; j++) {
+            work[col * k + j] = gf_mul(work[col * k + j], scale);
+            decode[col * k + j] = gf_mul(decode[col * k + j], scale);
+        }
+
+        for (int r = 0; r < k; r++) {
+            uint8_t f = work[r * k + col];
+            if (r == col || f == 0) continue;
+            for (int j = 0; j < k; j++) {
+                work[r * k + j] ^= gf_mul(f, work[col * k + j]);
+                decode[r * k + j] ^= gf_mul(f, decode[col * k + j]);
+            }
+        }
+    }
+    return 0;
+}
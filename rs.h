@@ -0,0 +1,38 @@
+// Reed-Solomon erasure code over GF(2^8) for dfc's k+m mode, and its benchmark (rs_bench)
+//systematic: shards 0..k-1 are the data itself, k..k+m-1 are parity rows of a Cauchy matrix,
+//so any k of the k+m shards give back the data
+#ifndef RS_H
+#define RS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RS_MAX_SHARDS 32
+
+typedef struct {
+    int k;
+    int m;
+    uint8_t matrix[RS_MAX_SHARDS * RS_MAX_SHARDS];  // (k+m) x k generator, row r makes shard r
+} rs_code;
+
+// k data + m parity shards; -1 if out of range
+int rs_init(rs_code *rs, int k, int m);
+
+// out = generator row `shard` applied to the k data buffers (for a parity shard, row >= k)
+void rs_encode_row(const rs_code *rs, int shard, const uint8_t *const *data, uint8_t *out, size_t len);
+
+// k x k matrix that turns the shards listed in rows[] back into the data shards:
+//data[d] = sum over j of decode[d * k + j] * shard[rows[j]]; -1 if rows repeat
+int rs_decoder(const rs_code *rs, const int *rows, uint8_t *decode);
+
+// out = sum of coeffs[i] * src[i] over n buffers
+void rs_combine(const uint8_t *coeffs, int n, const uint8_t *const *src, uint8_t *out, size_t len);
+
+// dst ^= c * src, with the fastest kernel this cpu has
+void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+// kernel in use ("avx2", "ssse3" or "scalar"); gf_set_kernel picks one, -1 if the cpu lacks it
+const char *gf_kernel_name(void);
+int gf_set_kernel(const char *name);
+
+#endif
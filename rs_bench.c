@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "rs.h"
+
+// Reed-Solomon throughput per GF kernel: encode all parity, then rebuild m lost data shards
+//usage: rs_bench [k] [m] [shard KB] [rounds]
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int k = argc > 1 ? atoi(argv[1]) : 4;
+    int m = argc > 2 ? atoi(argv[2]) : 2;
+    size_t shard = (argc > 3 ? atol(argv[3]) : 1024) * 1024;
+    int rounds = argc > 4 ? atoi(argv[4]) : 20;
+
+    rs_code rs;
+    if (rs_init(&rs, k, m) < 0 || m > k || shard == 0 || rounds < 1) {
+        printf("usage: %s [k] [m] [shard KB] [rounds]  (k+m <= %d, m <= k)\n", argv[0], RS_MAX_SHARDS);
+        return 1;
+    }
+
+    // k data + m parity shards, and copies of the data to check the rebuild against
+    uint8_t *shards[RS_MAX_SHARDS], *saved[RS_MAX_SHARDS];
+    for (int i = 0; i < k + m; i++) {
+        shards[i] = malloc(shard);
+        saved[i] = malloc(shard);
+        if (!shards[i] || !saved[i]) {
+            perror("memory allocation failed");
+            return 1;
+        }
+    }
+    srand(1);
+    for (int i = 0; i < k; i++) {
+        for (size_t b = 0; b < shard; b++) shards[i][b] = rand();
+        memcpy(saved[i], shards[i], shard);
+    }
+
+    // lose the first m data shards, rebuild them from the rest
+    int rows[RS_MAX_SHARDS];
+    for (int j = 0; j < k; j++) rows[j] = j + m;
+    uint8_t decode[RS_MAX_SHARDS * RS_MAX_SHARDS];
+    if (rs_decoder(&rs, rows, decode) < 0) {
+        printf("error: decode matrix is singular\n");
+        return 1;
+    }
+    const uint8_t *sources[RS_MAX_SHARDS];
+    for (int j = 0; j < k; j++) sources[j] = shards[rows[j]];
+
+    double data_mb = (double)k * shard * rounds / 1e6;
+    printf("k=%d m=%d, %zu KB shards, %d rounds (%.0f MB of data each way)\n\n", k, m, shard / 1024, rounds, data_mb);
+    printf("  %-8s %12s %12s\n", "kernel", "encode MB/s", "decode MB/s");
+
+    const char *kernels[] = {"scalar", "ssse3", "avx2"};
+    for (int n = 0; n < 3; n++) {
+        if (gf_set_kernel(kernels[n]) < 0) {
+            printf("  %-8s %12s %12s\n", kernels[n], "-", "-");
+            continue;
+        }
+
+        double start = now_sec();
+        for (int r = 0; r < rounds; r++) {
+            for (int p = k; p < k + m; p++) {
+                rs_encode_row(&rs, p, (const uint8_t *const *)shards, shards[p], shard);
+            }
+        }
+        double encode = now_sec() - start;
+
+        start = now_sec();
+        for (int r = 0; r < rounds; r++) {
+            for (int d = 0; d < m; d++) {
+                rs_combine(decode + d * k, k, sources, shards[d], shard);
+            }
+        }
+        double rebuild = now_sec() - start;
+
+        for (int d = 0; d < k; d++) {
+            if (memcmp(shards[d], saved[d], shard) != 0) {
+                printf("error: %s rebuilt shard %d wrong\n", kernels[n], d);
+                return 1;
+            }
+        }
+        printf("  %-8s %12.0f %12.0f\n", kernels[n], data_mb / encode, data_mb / rebuild);
+    }
+
+    for (int i = 0; i < k + m; i++) {
+        free(shards[i]);
+        free(saved[i]);
+    }
+    return 0;
+}